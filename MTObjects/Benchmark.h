@@ -0,0 +1,1292 @@
+#pragma once
+
+#include "FrameScheduler.h"
+#include "Sharding.h"
+#include "ObjectRegistry.h"
+#include "ScheduleSimulator.h"
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace MTObjects
+{
+
+class TestObject final : public IThreadSafeObject
+{
+public:
+	vector<uint64_t> payload_; // read and written by Task, see task_memory_. First, in the cache line the scheduler prefetches.
+	vector<TestObject*> dependencies_;
+	vector<const TestObject*> const_dependencies_;
+
+	int id_ = -1;
+	EPriority priority_ = EPriority::Normal;
+	unsigned int work_ = 0; // loop iterations burnt by Task
+	uint64_t state_ = 0; // derived by Task from the own state and the state of the const dependencies, see update_state_
+	bool update_state_ = false; // off by default, the reads of the const dependencies would dominate Execution
+	ObjectRegistry* registry_ = nullptr; // set for the objects of a churn case, see Churn
+	bool spawns_ = false;
+	bool short_lived_ = false;
+
+	void IsDependentOn(FastContainer<IThreadSafeObject*>& ref_dependencies) const override
+	{
+		ref_dependencies.Insert(*(vector<IThreadSafeObject*>*)&dependencies_);
+	}
+
+	void IsConstDependentOn(IndexSet& ref_dependencies) const override
+	{
+		for (auto obj : const_dependencies_)
+		{
+			// Not clustered - an object of another shard, see Sharding.h
+			if (kNullIndex != obj->GetClusterIndex())
+			{
+				ref_dependencies[obj->GetClusterIndex()] = true;
+			}
+		}
+	}
+
+	void GetConstDependencies(vector<const IThreadSafeObject*>& out_dependencies) const override
+	{
+		out_dependencies.insert(out_dependencies.end(), const_dependencies_.begin(), const_dependencies_.end());
+	}
+
+	// Cached by GetDependencyFingerprint, 0 - not computed yet. Reset it whenever the dependencies change.
+	mutable uint64_t fingerprint_ = 0;
+
+	uint64_t GetDependencyFingerprint() const override
+	{
+		if (0 == fingerprint_)
+		{
+			uint64_t fingerprint = reinterpret_cast<uintptr_t>(this);
+			for (auto obj : dependencies_)
+			{
+				fingerprint = fingerprint * 31 + reinterpret_cast<uintptr_t>(obj);
+			}
+			for (auto obj : const_dependencies_)
+			{
+				fingerprint = fingerprint * 37 + reinterpret_cast<uintptr_t>(obj);
+			}
+			fingerprint_ = fingerprint | 1;
+		}
+		return fingerprint_;
+	}
+
+	EPriority GetPriority() const override { return priority_; }
+	unsigned int GetCost() const override { return work_; }
+
+	unsigned int WriteSharedState(void* out_data) const override
+	{
+		std::memcpy(out_data, &state_, sizeof(state_));
+		return sizeof(state_);
+	}
+
+	void ReadSharedState(const void* data, unsigned int size) override
+	{
+		Assert(sizeof(state_) == size);
+		std::memcpy(&state_, data, size);
+	}
+
+	void UpdateState()
+	{
+		if (!update_state_)
+			return;
+		uint64_t state = state_ * 31 + 1;
+		for (auto obj : const_dependencies_)
+		{
+			state += obj->state_;
+		}
+		state_ = state;
+	}
+
+	// The same work in every phase
+	void PhaseTask(unsigned int) override { RunTask(); }
+
+	/*
+	A spawner spawns a short-lived object with its own work, the short-lived object destroys itself in its first task. It depends
+	on its spawner, so it joins the spawner's cluster instead of adding one, nothing depends on it.
+	*/
+	void Churn()
+	{
+		if (!registry_)
+			return;
+		if (short_lived_)
+		{
+			registry_->Destroy(this);
+		}
+		else if (spawns_)
+		{
+			TestObject* obj = new TestObject();
+			obj->id_ = id_;
+			obj->priority_ = priority_;
+			obj->work_ = work_;
+			obj->registry_ = registry_;
+			obj->short_lived_ = true;
+			obj->dependencies_.push_back(this);
+			registry_->Spawn(obj);
+		}
+	}
+
+	static const constexpr unsigned int kMaxPrefetchHintBytes = 256; // further lines are left to the hardware prefetcher
+
+	void PrefetchHint() const override
+	{
+		const char* const payload = reinterpret_cast<const char*>(payload_.data());
+		const size_t num_bytes = std::min<size_t>(payload_.size() * sizeof(uint64_t), kMaxPrefetchHintBytes);
+		for (size_t offset = 0; offset < num_bytes; offset += 64)
+		{
+			Prefetch(payload + offset);
+		}
+	}
+
+	void TouchPayload()
+	{
+		uint64_t sum = state_;
+		for (uint64_t& value : payload_)
+		{
+			sum += value;
+			value = sum;
+		}
+	}
+
+	void Task() override
+	{
+		UpdateState();
+		TouchPayload();
+		volatile unsigned int sink = 0;
+		for (unsigned int unit = work_; unit > 0; unit--)
+		{
+			sink = sink + unit;
+		}
+		Churn();
+	}
+
+#if MTOBJECTS_COROUTINES
+	static const constexpr unsigned int kYieldInterval = 4096; // loop iterations between yield points
+
+	// Task with a yield point every kYieldInterval iterations, used by heavy objects (cooperative_).
+	CooperativeTask RunCooperative() override
+	{
+		UpdateState();
+		TouchPayload();
+		volatile unsigned int sink = 0;
+		for (unsigned int unit = work_; unit > 0; unit--)
+		{
+			sink = sink + unit;
+			if (0 == unit % kYieldInterval)
+			{
+				co_await CooperativeStuff::Yield();
+			}
+		}
+		Churn();
+	}
+#endif
+};
+
+inline vector<TestObject*> GenerateObjects(int num_objects, int forced_clusters_num, int dependencies_num, int const_dependencies_num, std::default_random_engine& generator)
+{
+	std::clog << "Generating objects..." << std::endl;
+
+	vector<TestObject*> vec_obj;
+	vector<vector<TestObject*>> forced_clusters;
+
+	vec_obj.resize(num_objects);
+	for (int i = 0; i < num_objects; i++)
+	{
+		vec_obj[i] = new TestObject();
+	}
+	const bool use_forced_clusters = forced_clusters_num > 1;
+	if (use_forced_clusters)
+	{
+		forced_clusters.clear();
+		forced_clusters.resize(forced_clusters_num);
+	}
+
+	for (int i = 0; i < num_objects; i++)
+	{
+		TestObject& obj = *vec_obj[i];
+		obj.id_ = i;
+		if (use_forced_clusters)
+		{
+			{
+				std::uniform_int_distribution<int> cluster_distribution(0, forced_clusters_num - 1);
+				const int forced_cluster_idx = cluster_distribution(generator);
+				vector<TestObject*>& cluster = forced_clusters[forced_cluster_idx];
+				const size_t actual_dependency_num = std::min<size_t>(dependencies_num, cluster.size());
+				if (actual_dependency_num > 0)
+				{
+					std::uniform_int_distribution<size_t> dependency_distribution(0, cluster.size() - 1);
+					for (int j = 0; j < dependencies_num; j++)
+					{
+						auto dep_obj = cluster[dependency_distribution(generator)];
+						obj.dependencies_.emplace_back(dep_obj);
+					}
+				}
+				cluster.push_back(&obj);
+			}
+
+			{
+				//Const deps goes only to the first num_of_const_dep_sources clusters
+				const int num_of_const_dep_sources = std::min(8, forced_clusters_num);
+				std::uniform_int_distribution<size_t> const_dep_source_dependency_distribution(0, num_of_const_dep_sources - 1);
+				const auto forced_cluster_idx = const_dep_source_dependency_distribution(generator);
+				const vector<TestObject*>& cluster = forced_clusters[forced_cluster_idx];
+				const size_t actual_dependency_num = std::min<size_t>(const_dependencies_num, cluster.size());
+				if (actual_dependency_num > 0)
+				{
+					std::uniform_int_distribution<size_t> dependency_distribution(0, cluster.size() - 1);
+					for (int j = 0; j < const_dependencies_num; j++)
+					{
+						auto dep_obj = cluster[dependency_distribution(generator)];
+						obj.const_dependencies_.emplace_back(dep_obj);
+					}
+				}
+			}
+		}
+		else
+		{
+			std::uniform_int_distribution<int> dependency_distribution(0, num_objects - 1);
+			for (int j = 0; j < dependencies_num; j++)
+			{
+				auto dep_obj = vec_obj[dependency_distribution(generator)];
+				obj.dependencies_.emplace_back(dep_obj);
+			}
+
+			for (int j = 0; j < const_dependencies_num; j++)
+			{
+				auto const_dep_obj = vec_obj[dependency_distribution(generator)];
+				obj.const_dependencies_.emplace_back(const_dep_obj);
+			}
+		}
+	}
+
+	std::clog << "Objects were generated." << std::endl;
+
+	return vec_obj;
+}
+
+inline vector<IThreadSafeObject*> ShuffleObjects(vector<TestObject*>& vec_obj)
+{
+	vector<IThreadSafeObject*> all_objects;
+	all_objects.reserve(vec_obj.size());
+	for (unsigned int i = 0; i < vec_obj.size(); i++)
+	{
+		all_objects.emplace_back(vec_obj[i]);
+	}
+
+	std::mt19937 randomizer;
+	std::shuffle(all_objects.begin(), all_objects.end(), randomizer);
+	return all_objects;
+}
+
+inline void DestroyObjects(vector<TestObject*>& vec_obj)
+{
+	for (auto obj : vec_obj)
+	{
+		delete obj;
+	}
+	vec_obj.clear();
+}
+
+struct Statistics
+{
+	double median_ = 0.0;
+	double p99_ = 0.0;
+	double mean_ = 0.0;
+	double min_ = 0.0;
+	double max_ = 0.0;
+
+	// Sorts the samples
+	static Statistics From(vector<double>& samples)
+	{
+		Statistics result;
+		if (samples.empty())
+			return result;
+		std::sort(samples.begin(), samples.end());
+		auto percentile = [&](double p)
+		{
+			const size_t idx = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+			return samples[std::min(idx, samples.size() - 1)];
+		};
+		result.median_ = percentile(0.5);
+		result.p99_ = percentile(0.99);
+		result.min_ = samples.front();
+		result.max_ = samples.back();
+		double sum = 0.0;
+		for (double sample : samples)
+		{
+			sum += sample;
+		}
+		result.mean_ = sum / samples.size();
+		return result;
+	}
+};
+
+enum class EGraphShape : unsigned char
+{
+	ForcedClusters,	// random assignment into forced clusters, uniform random dependencies when forced_clusters <= 1
+	PowerLaw,		// communities of power-law sizes, inside them few hubs are dependencies of most objects
+	Grid,			// spatial grid split into tiles, dependencies on neighbours inside the tile
+	Chains,			// long chains, every object depends on its closest predecessors
+	Islands,		// small independent islands, every object depends on random members of its island
+	Replay,			// loaded from a capture file (GraphCapture.h), not generated
+	Count
+};
+
+inline const char* ToString(EGraphShape shape)
+{
+	switch (shape)
+	{
+	case EGraphShape::ForcedClusters: return "forced_clusters";
+	case EGraphShape::PowerLaw: return "power_law";
+	case EGraphShape::Grid: return "grid";
+	case EGraphShape::Chains: return "chains";
+	case EGraphShape::Islands: return "islands";
+	case EGraphShape::Replay: return "replay";
+	default: return "unknown";
+	}
+}
+
+// Merges can leave empty cluster slots behind, so the generated regions must not use the whole cluster array.
+static const constexpr int kMaxRegions = static_cast<int>(kMaxClusters) - 16;
+
+struct BenchmarkCase
+{
+	EGraphShape shape_ = EGraphShape::ForcedClusters;
+	int num_objects_ = 64 * 1024;
+	int forced_clusters_ = 64; // number of regions (communities, tiles, chains, islands) for the other shapes
+	int dependencies_num_ = 16;
+	int const_dependencies_num_ = 8;
+	float const_locality_ = 0.5f; // probability that a const dependency is taken from the own or a neighbouring region
+	unsigned int num_threads_ = 0; // 0 - all hardware threads
+	EClusteringAlgorithm algorithm_ = EClusteringAlgorithm::Default;
+	bool schedule_cache_ = false;
+	bool group_worker_pool_ = true; // FrameScheduler::EnableGroupWorkerPool
+	bool adaptive_dispatch_ = true; // FrameScheduler::EnableAdaptiveDispatch
+	int graph_changes_percent_ = 0; // % of frames that change the dependencies of a random object
+	int critical_percent_ = 0; // % of objects with EPriority::Critical
+	int low_percent_ = 0; // % of objects with EPriority::Low, the rest is Normal
+	unsigned int task_work_ = 0; // loop iterations of every Task
+	float frame_budget_us_ = 0.0f; // 0 - no deadline
+	int heavy_percent_ = 0; // % of objects with kHeavyWorkFactor times task_work_, cooperative when coroutines are available
+	float time_slice_us_ = 0.0f; // 0 - clusters run to completion, see FrameScheduler::SetTimeSlice
+	unsigned int num_phases_ = 1; // every object runs its task once per phase
+	bool phase_graph_ = true; // with phases: FrameScheduler::ExecutePhases, otherwise the whole frame once per phase
+	int churn_percent_ = 0; // % of objects that spawn a short-lived object in every task, see TestObject::Churn
+	unsigned int task_memory_ = 0; // bytes of payload every Task reads and writes, in a separate allocation
+	unsigned int prefetch_distance_ = FrameScheduler::kDefaultPrefetchDistance; // FrameScheduler::SetPrefetchDistance
+
+	bool UsesPhaseGraph() const { return num_phases_ > 1 && phase_graph_; }
+	// The phase graph doesn't go through the group worker pool, nothing is inlined or batched.
+	bool ReportsDispatch() const { return group_worker_pool_ && !UsesPhaseGraph(); }
+};
+
+static const constexpr unsigned int kHeavyWorkFactor = 256;
+
+namespace GeneratorStuff
+{
+	/*
+	Objects of a region are connected: every object (except the first one) depends on at least one object created
+	before it in the same region. So every region ends up as exactly one cluster.
+	*/
+	using Regions = vector<vector<TestObject*>>;
+
+	inline void AddConstDependencies(const Regions& regions, const vector<TestObject*>& vec_obj, int const_dependencies_num, float const_locality, std::default_random_engine& generator)
+	{
+		std::uniform_real_distribution<float> locality_distribution(0.0f, 1.0f);
+		std::uniform_int_distribution<size_t> any_distribution(0, vec_obj.size() - 1);
+		std::uniform_int_distribution<int> neighbour_distribution(-1, 1);
+		for (size_t region_idx = 0; region_idx < regions.size(); region_idx++)
+		{
+			for (auto obj : regions[region_idx])
+			{
+				for (int j = 0; j < const_dependencies_num; j++)
+				{
+					const vector<TestObject*>* source = &vec_obj;
+					if (locality_distribution(generator) < const_locality)
+					{
+						const size_t neighbour_idx = (region_idx + regions.size() + neighbour_distribution(generator)) % regions.size();
+						source = &regions[neighbour_idx];
+					}
+					if (source->empty())
+						continue;
+					std::uniform_int_distribution<size_t> dependency_distribution(0, source->size() - 1);
+					obj->const_dependencies_.emplace_back((*source)[source == &vec_obj ? any_distribution(generator) : dependency_distribution(generator)]);
+				}
+			}
+		}
+	}
+
+	inline void GeneratePowerLaw(Regions& regions, vector<TestObject*>& vec_obj, int dependencies_num, std::default_random_engine& generator)
+	{
+		// Community r gets objects with weight 1/(r+1): one big community and a long tail of small ones.
+		vector<double> community_weights(regions.size());
+		for (size_t region_idx = 0; region_idx < regions.size(); region_idx++)
+		{
+			community_weights[region_idx] = 1.0 / (region_idx + 1);
+		}
+		std::discrete_distribution<size_t> community_distribution(community_weights.begin(), community_weights.end());
+
+		// Dependency on the k-th of n earlier members with probability ~ (k/n)^(1/kHubExponent - 1): the first members are hubs.
+		const double kHubExponent = 3.0;
+		std::uniform_real_distribution<double> hub_distribution(0.0, 1.0);
+		for (auto obj : vec_obj)
+		{
+			vector<TestObject*>& community = regions[community_distribution(generator)];
+			for (int j = 0; j < dependencies_num && !community.empty(); j++)
+			{
+				const size_t dep_idx = static_cast<size_t>(community.size() * std::pow(hub_distribution(generator), kHubExponent));
+				obj->dependencies_.emplace_back(community[std::min(dep_idx, community.size() - 1)]);
+			}
+			community.push_back(obj);
+		}
+	}
+
+	inline void GenerateGrid(Regions& regions, vector<TestObject*>& vec_obj, int dependencies_num, std::default_random_engine& generator)
+	{
+		const int kRadius = 2;
+		const int num_objects = static_cast<int>(vec_obj.size());
+		const int side = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(num_objects)))));
+		const int tiles_per_side = std::max(1, static_cast<int>(std::sqrt(static_cast<double>(regions.size()))));
+		regions.resize(tiles_per_side * tiles_per_side);
+		auto tile_of = [&](int x, int y) { return (y * tiles_per_side / side) * tiles_per_side + (x * tiles_per_side / side); };
+
+		std::uniform_int_distribution<int> offset_distribution(-kRadius, kRadius);
+		for (int obj_idx = 0; obj_idx < num_objects; obj_idx++)
+		{
+			const int x = obj_idx % side;
+			const int y = obj_idx / side;
+			const int tile = tile_of(x, y);
+			TestObject* obj = vec_obj[obj_idx];
+
+			// The left (or the upper) neighbour keeps the tile connected.
+			const int first_x = (x > 0 && tile_of(x - 1, y) == tile) ? x - 1 : x;
+			const int first_y = (first_x == x) ? y - 1 : y;
+			if (first_y >= 0 && tile_of(first_x, first_y) == tile)
+			{
+				obj->dependencies_.emplace_back(vec_obj[first_y * side + first_x]);
+			}
+			for (int j = 1; j < dependencies_num; j++)
+			{
+				const int dep_x = x + offset_distribution(generator);
+				const int dep_y = y + offset_distribution(generator);
+				const int dep_idx = dep_y * side + dep_x;
+				if (dep_x < 0 || dep_x >= side || dep_y < 0 || dep_idx >= num_objects || dep_idx == obj_idx || tile_of(dep_x, dep_y) != tile)
+					continue;
+				obj->dependencies_.emplace_back(vec_obj[dep_idx]);
+			}
+			regions[tile].push_back(obj);
+		}
+	}
+
+	inline void GenerateChains(Regions& regions, vector<TestObject*>& vec_obj, int dependencies_num, std::default_random_engine& generator)
+	{
+		const size_t kWindow = 8;
+		for (size_t obj_idx = 0; obj_idx < vec_obj.size(); obj_idx++)
+		{
+			vector<TestObject*>& chain = regions[obj_idx % regions.size()];
+			TestObject* obj = vec_obj[obj_idx];
+			if (!chain.empty())
+			{
+				obj->dependencies_.emplace_back(chain.back());
+				const size_t window = std::min(kWindow, chain.size());
+				std::uniform_int_distribution<size_t> window_distribution(1, window);
+				for (int j = 1; j < dependencies_num; j++)
+				{
+					obj->dependencies_.emplace_back(chain[chain.size() - window_distribution(generator)]);
+				}
+			}
+			chain.push_back(obj);
+		}
+	}
+
+	inline void GenerateIslands(Regions& regions, vector<TestObject*>& vec_obj, int dependencies_num, std::default_random_engine& generator)
+	{
+		std::uniform_int_distribution<size_t> island_distribution(0, regions.size() - 1);
+		for (auto obj : vec_obj)
+		{
+			vector<TestObject*>& island = regions[island_distribution(generator)];
+			if (!island.empty())
+			{
+				std::uniform_int_distribution<size_t> member_distribution(0, island.size() - 1);
+				for (int j = 0; j < dependencies_num; j++)
+				{
+					obj->dependencies_.emplace_back(island[member_distribution(generator)]);
+				}
+			}
+			island.push_back(obj);
+		}
+	}
+}
+
+/*
+Generates the objects of the given shape. The number of regions is clamped to kMaxRegions and every object has
+at least one dependency inside its region, so the number of clusters never exceeds the capacity of ClusterArray.
+*/
+inline vector<TestObject*> GenerateObjects(const BenchmarkCase& benchmark_case, std::default_random_engine& generator)
+{
+	using namespace GeneratorStuff;
+	if (EGraphShape::ForcedClusters == benchmark_case.shape_)
+		return GenerateObjects(benchmark_case.num_objects_, benchmark_case.forced_clusters_, benchmark_case.dependencies_num_, benchmark_case.const_dependencies_num_, generator);
+
+	std::clog << "Generating " << ToString(benchmark_case.shape_) << " objects..." << std::endl;
+	vector<TestObject*> vec_obj(benchmark_case.num_objects_);
+	for (int i = 0; i < benchmark_case.num_objects_; i++)
+	{
+		vec_obj[i] = new TestObject();
+		vec_obj[i]->id_ = i;
+	}
+
+	Regions regions(std::min(std::max(1, benchmark_case.forced_clusters_), kMaxRegions));
+	const int dependencies_num = std::max(1, benchmark_case.dependencies_num_);
+	switch (benchmark_case.shape_)
+	{
+	case EGraphShape::PowerLaw: GeneratePowerLaw(regions, vec_obj, dependencies_num, generator); break;
+	case EGraphShape::Grid: GenerateGrid(regions, vec_obj, dependencies_num, generator); break;
+	case EGraphShape::Chains: GenerateChains(regions, vec_obj, dependencies_num, generator); break;
+	case EGraphShape::Islands: GenerateIslands(regions, vec_obj, dependencies_num, generator); break;
+	default: Assert(false); break;
+	}
+	AddConstDependencies(regions, vec_obj, benchmark_case.const_dependencies_num_, benchmark_case.const_locality_, generator);
+
+	std::clog << "Objects were generated." << std::endl;
+	return vec_obj;
+}
+
+// Random priorities and the Task cost and memory of the case. Uses its own generator, so the graph doesn't depend on the priorities.
+inline void AssignPriorities(const BenchmarkCase& benchmark_case, vector<TestObject*>& vec_obj)
+{
+	std::default_random_engine generator;
+	std::default_random_engine heavy_generator(1);
+	std::uniform_int_distribution<int> percent_distribution(0, 99);
+	for (auto obj : vec_obj)
+	{
+		const int percent = percent_distribution(generator);
+		obj->priority_ = (percent < benchmark_case.critical_percent_) ? EPriority::Critical
+			: ((percent >= 100 - benchmark_case.low_percent_) ? EPriority::Low : EPriority::Normal);
+		const bool heavy = percent_distribution(heavy_generator) < benchmark_case.heavy_percent_;
+		obj->work_ = heavy ? benchmark_case.task_work_ * kHeavyWorkFactor : benchmark_case.task_work_;
+#if MTOBJECTS_COROUTINES
+		obj->cooperative_ = heavy;
+#endif
+		obj->payload_.assign(benchmark_case.task_memory_ / sizeof(uint64_t), static_cast<uint64_t>(obj->id_));
+	}
+}
+
+enum class EPhase : unsigned char
+{
+	ScheduleCache,	// key computation and restore, or store on a miss
+	CreateClusters,
+	CreateClustersDependencies,
+	GenerateClusterGroups,
+	Execution,
+	ObjectChanges,	// ObjectRegistry::ApplyPendingChanges of the churn
+	Count
+};
+
+inline const char* ToString(EPhase phase)
+{
+	switch (phase)
+	{
+	case EPhase::ScheduleCache: return "ScheduleCache";
+	case EPhase::CreateClusters: return "CreateClusters";
+	case EPhase::CreateClustersDependencies: return "CreateClustersDependencies";
+	case EPhase::GenerateClusterGroups: return "GenerateClusterGroups";
+	case EPhase::Execution: return "Execution";
+	case EPhase::ObjectChanges: return "ObjectChanges";
+	default: return "unknown";
+	}
+}
+
+struct BenchmarkResult
+{
+	BenchmarkCase case_;
+	unsigned int num_threads_ = 0;
+	int repeat_ = 0;
+	unsigned int num_clusters_ = 0;
+	unsigned int num_groups_ = 0;
+	Statistics frame_us_;
+	Statistics phase_us_[static_cast<size_t>(EPhase::Count)];
+	double objects_per_second_ = 0.0;
+	double schedule_cache_hit_rate_ = 0.0;
+	double schedule_cache_saved_us_per_frame_ = 0.0; // (median scheduling time of a miss - of a hit) * hit rate
+	std::array<uint64_t, ClusteringPolicy::kNumAlgorithms> adaptive_choices_ = {}; // frames per algorithm chosen by the policy
+	int deadline_misses_ = 0; // measured frames that ended after the frame budget
+	double deferred_clusters_per_frame_ = 0.0;
+	double deferred_objects_per_frame_ = 0.0;
+	double clusters_yielded_per_frame_ = 0.0; // suspended at the end of a time slice
+	double groups_inlined_per_frame_ = 0.0; // tiers run inline by the group worker pool
+	double cluster_batches_per_frame_ = 0.0;
+	unsigned int inline_threshold_ = 0; // objects, after the last frame
+	unsigned int batch_threshold_ = 0;
+	double baseline_frame_us_ = 0.0; // median frame of the same variant in a build without telemetry, 0 - not known
+};
+
+/*
+Changes the graph without changing its clusters: adds a duplicate of an existing dependency to a random object, or removes
+the duplicate again. Only the fingerprint of the graph changes.
+*/
+inline void ChangeGraph(vector<TestObject*>& vec_obj, std::default_random_engine& generator)
+{
+	std::uniform_int_distribution<size_t> object_distribution(0, vec_obj.size() - 1);
+	TestObject& obj = *vec_obj[object_distribution(generator)];
+	const size_t num_dependencies = obj.dependencies_.size();
+	if (0 == num_dependencies)
+		return;
+	if (num_dependencies > 1 && obj.dependencies_[num_dependencies - 1] == obj.dependencies_[0])
+	{
+		obj.dependencies_.pop_back();
+	}
+	else
+	{
+		obj.dependencies_.push_back(obj.dependencies_[0]);
+	}
+	obj.fingerprint_ = 0;
+}
+
+struct ShardedBenchmarkResult
+{
+	BenchmarkCase case_;
+	unsigned int num_shards_ = 0;
+	unsigned int threads_per_shard_ = 0;
+	bool succeeded_ = false;
+	vector<Sharding::ShardResult> shards_;
+	uint64_t checksum_ = 0; // of the final state of all objects
+	uint64_t reference_checksum_ = 0; // the same frames in one process, see RunShardedReference
+};
+
+/*
+The frames of a sharded run in the calling process, shard after shard with the same partition. Every shard reads the objects
+of the other shards as they were at the start of the frame, like its mirrors do in the sharded run, so the checksum of the
+final state must be the one of the sharded run.
+*/
+inline uint64_t RunShardedReference(const BenchmarkCase& benchmark_case, const vector<IThreadSafeObject*>& all_objects, const Sharding::ShardedWorld& world,
+	unsigned int threads_per_shard, int num_frames)
+{
+	Parallel::SetNumThreads(threads_per_shard);
+	std::unique_ptr<FrameScheduler> scheduler(new FrameScheduler());
+	scheduler->Calibrate();
+	scheduler->SetClusteringAlgorithm(benchmark_case.algorithm_);
+	vector<vector<IThreadSafeObject*>> shard_objects(world.GetNumShards());
+	for (size_t obj_idx = 0; obj_idx < all_objects.size(); obj_idx++)
+	{
+		const unsigned int shard_idx = world.GetShardOfObject(obj_idx);
+		shard_objects[shard_idx].push_back(all_objects[obj_idx]);
+	}
+	vector<uint64_t> frame_start_states(all_objects.size());
+	vector<uint64_t> frame_end_states(all_objects.size());
+	auto for_each_state = [&all_objects](auto&& fn)
+	{
+		for (size_t obj_idx = 0; obj_idx < all_objects.size(); obj_idx++)
+		{
+			fn(static_cast<TestObject*>(all_objects[obj_idx])->state_, obj_idx);
+		}
+	};
+	for (int frame = 0; frame < num_frames; frame++)
+	{
+		for_each_state([&](uint64_t& state, size_t obj_idx) { frame_start_states[obj_idx] = state; });
+		for (unsigned int shard_idx = 0; shard_idx < world.GetNumShards(); shard_idx++)
+		{
+			for_each_state([&](uint64_t& state, size_t obj_idx) { state = frame_start_states[obj_idx]; });
+			scheduler->ExecuteFrame(shard_objects[shard_idx]);
+			for_each_state([&](uint64_t& state, size_t obj_idx)
+			{
+				if (shard_idx == world.GetShardOfObject(obj_idx))
+				{
+					frame_end_states[obj_idx] = state;
+				}
+			});
+		}
+		for_each_state([&](uint64_t& state, size_t obj_idx) { state = frame_end_states[obj_idx]; });
+	}
+	uint64_t checksum = 0;
+	for_each_state([&](uint64_t& state, size_t) { checksum += state; });
+	return checksum;
+}
+
+/*
+Runs warmup + repeat frames of the case in num_shards processes (Sharding.h). Every frame is ExecuteFrame of the own objects
+followed by the state exchange. Then the same frames run in the calling process for the reference checksum, the objects are
+left with their initial state.
+*/
+inline ShardedBenchmarkResult RunShardedBenchmark(const BenchmarkCase& benchmark_case, const vector<IThreadSafeObject*>& all_objects, unsigned int num_shards,
+	unsigned int threads_per_shard, int warmup, int repeat)
+{
+	ShardedBenchmarkResult result;
+	result.case_ = benchmark_case;
+	for (auto obj : all_objects)
+	{
+		static_cast<TestObject*>(obj)->update_state_ = true;
+	}
+	result.threads_per_shard_ = threads_per_shard;
+	Sharding::ShardedWorld world(all_objects, num_shards);
+	result.num_shards_ = world.GetNumShards();
+	result.succeeded_ = world.Run([&](Sharding::ShardContext& context)
+	{
+		Parallel::SetNumThreads(threads_per_shard);
+		std::unique_ptr<FrameScheduler> scheduler(new FrameScheduler());
+		scheduler->Calibrate();
+		scheduler->SetClusteringAlgorithm(benchmark_case.algorithm_);
+		vector<double> frame_samples;
+		vector<double> exchange_samples;
+		for (int i = -warmup; i < repeat; i++)
+		{
+			const auto time_0 = std::chrono::steady_clock::now();
+			scheduler->ExecuteFrame(context.GetLocalObjects());
+			const auto time_1 = std::chrono::steady_clock::now();
+			if (!context.ExchangeStates())
+				return;
+			const auto time_2 = std::chrono::steady_clock::now();
+			if (i < 0)
+				continue;
+			frame_samples.push_back(std::chrono::duration<double, std::micro>(time_1 - time_0).count());
+			exchange_samples.push_back(std::chrono::duration<double, std::micro>(time_2 - time_1).count());
+		}
+		Sharding::ShardResult& shard_result = context.GetResult();
+		shard_result.num_frames_ = static_cast<uint32_t>(frame_samples.size());
+		shard_result.frame_us_ = Statistics::From(frame_samples).median_;
+		shard_result.exchange_us_ = Statistics::From(exchange_samples).median_;
+		for (auto obj : context.GetLocalObjects())
+		{
+			shard_result.checksum_ += static_cast<TestObject*>(obj)->state_;
+		}
+	});
+	for (unsigned int shard_idx = 0; shard_idx < result.num_shards_; shard_idx++)
+	{
+		result.shards_.push_back(world.GetResult(shard_idx));
+		result.checksum_ += result.shards_.back().checksum_;
+	}
+	vector<uint64_t> initial_states;
+	initial_states.reserve(all_objects.size());
+	for (auto obj : all_objects)
+	{
+		initial_states.push_back(static_cast<TestObject*>(obj)->state_);
+	}
+	result.reference_checksum_ = RunShardedReference(benchmark_case, all_objects, world, threads_per_shard, warmup + repeat);
+	for (size_t obj_idx = 0; obj_idx < all_objects.size(); obj_idx++)
+	{
+		TestObject* obj = static_cast<TestObject*>(all_objects[obj_idx]);
+		obj->state_ = initial_states[obj_idx];
+		obj->update_state_ = false;
+	}
+	return result;
+}
+
+inline void WriteJson(std::ostream& out, const vector<ShardedBenchmarkResult>& results)
+{
+	out << "{" << std::endl;
+	out << "  \"backend\": \"" << Parallel::kBackendName << "\"," << std::endl;
+	out << "  \"sharded_results\": [";
+	for (size_t result_idx = 0; result_idx < results.size(); result_idx++)
+	{
+		const ShardedBenchmarkResult& result = results[result_idx];
+		out << (result_idx ? "," : "") << std::endl << "    {";
+		out << "\"shape\": \"" << ToString(result.case_.shape_) << "\"";
+		out << ", \"objects\": " << result.case_.num_objects_;
+		out << ", \"forced_clusters\": " << result.case_.forced_clusters_;
+		out << ", \"const_dependencies\": " << result.case_.const_dependencies_num_;
+		out << ", \"const_locality\": " << result.case_.const_locality_;
+		out << ", \"algorithm\": \"" << ToString(result.case_.algorithm_) << "\"";
+		out << ", \"shards\": " << result.num_shards_;
+		out << ", \"threads_per_shard\": " << result.threads_per_shard_;
+		out << ", \"succeeded\": " << (result.succeeded_ ? "true" : "false");
+		out << ", \"checksum\": " << result.checksum_;
+		out << ", \"reference_checksum\": " << result.reference_checksum_;
+		out << ", \"checksum_matches\": " << (result.checksum_ == result.reference_checksum_ ? "true" : "false");
+		out << ", \"per_shard\": [";
+		for (size_t shard_idx = 0; shard_idx < result.shards_.size(); shard_idx++)
+		{
+			const Sharding::ShardResult& shard = result.shards_[shard_idx];
+			out << (shard_idx ? ", " : "") << "{\"objects\": " << shard.num_objects_
+				<< ", \"exported_per_frame\": " << shard.num_exported_
+				<< ", \"imported_per_frame\": " << shard.num_imported_
+				<< ", \"frames\": " << shard.num_frames_
+				<< ", \"frame_us\": " << shard.frame_us_
+				<< ", \"exchange_us\": " << shard.exchange_us_ << "}";
+		}
+		out << "]}";
+	}
+	out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+/*
+Runs warmup + repeat frames of the case and measures every phase.
+changeable_objects (the objects behind all_objects) are needed only when the case changes the graph or churns.
+With churn the frames run on an ObjectRegistry of all_objects, the short-lived objects are deleted at the end.
+*/
+inline BenchmarkResult RunBenchmarkCase(const BenchmarkCase& benchmark_case, const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, int warmup, int repeat,
+	vector<TestObject*>* changeable_objects = nullptr)
+{
+	const bool churn = changeable_objects && benchmark_case.churn_percent_ > 0;
+	ObjectRegistry registry;
+	if (churn)
+	{
+		std::default_random_engine churn_generator;
+		std::uniform_int_distribution<int> percent_distribution(0, 99);
+		registry.Reserve(static_cast<unsigned int>(all_objects.size() * 2));
+		for (TestObject* obj : *changeable_objects)
+		{
+			obj->registry_ = &registry;
+			obj->spawns_ = percent_distribution(churn_generator) < benchmark_case.churn_percent_;
+		}
+		for (IThreadSafeObject* obj : all_objects)
+		{
+			registry.Add(obj);
+		}
+	}
+	const vector<IThreadSafeObject*>& objects = churn ? registry.GetObjects() : all_objects;
+	auto delete_short_lived = [](IThreadSafeObject* obj) { delete static_cast<TestObject*>(obj); }; // TestObject is final
+
+	Parallel::SetNumThreads(benchmark_case.num_threads_);
+	scheduler.SetClusteringAlgorithm(benchmark_case.algorithm_);
+	scheduler.EnableScheduleCache(benchmark_case.schedule_cache_);
+	scheduler.EnableGroupWorkerPool(benchmark_case.group_worker_pool_);
+	scheduler.EnableAdaptiveDispatch(benchmark_case.adaptive_dispatch_);
+	if (benchmark_case.group_worker_pool_ && benchmark_case.adaptive_dispatch_ && !scheduler.IsCalibrated())
+	{
+		scheduler.Calibrate(); // outside of the timed frames
+	}
+	scheduler.SetPrefetchDistance(benchmark_case.prefetch_distance_);
+	scheduler.SetFrameBudget(benchmark_case.frame_budget_us_);
+#if MTOBJECTS_COROUTINES
+	scheduler.SetTimeSlice(benchmark_case.time_slice_us_);
+#endif
+	std::array<uint64_t, ClusteringPolicy::kNumAlgorithms> choices_before = {};
+	for (unsigned int idx = 0; idx < ClusteringPolicy::kNumAlgorithms; idx++)
+	{
+		choices_before[idx] = scheduler.GetClusteringPolicy().GetNumChoices(static_cast<EClusteringAlgorithm>(idx));
+	}
+	std::default_random_engine change_generator;
+	std::uniform_int_distribution<int> change_distribution(0, 99);
+	vector<double> hit_samples;
+	vector<double> miss_samples;
+	int num_hits = 0;
+	uint64_t num_deferred_clusters = 0;
+	uint64_t num_deferred_objects = 0;
+	uint64_t num_yielded_clusters = 0;
+	uint64_t num_inlined_groups = 0;
+	uint64_t num_cluster_batches = 0;
+
+	BenchmarkResult result;
+	result.case_ = benchmark_case;
+	result.num_threads_ = Parallel::NumThreads();
+	result.repeat_ = repeat;
+
+	vector<double> frame_samples;
+	vector<double> phase_samples[static_cast<size_t>(EPhase::Count)];
+	frame_samples.reserve(repeat);
+	hit_samples.reserve(warmup + repeat);
+	miss_samples.reserve(warmup + repeat);
+	for (auto& samples : phase_samples)
+	{
+		samples.reserve(repeat);
+	}
+
+	for (int i = -warmup; i < repeat; i++)
+	{
+		double phase_us[static_cast<size_t>(EPhase::Count)] = {};
+		auto measure = [&](EPhase phase, auto&& function)
+		{
+			const auto time_0 = std::chrono::steady_clock::now();
+			function();
+			const auto time_1 = std::chrono::steady_clock::now();
+			phase_us[static_cast<size_t>(phase)] += std::chrono::duration<double, std::micro>(time_1 - time_0).count();
+		};
+
+		if (changeable_objects && change_distribution(change_generator) < benchmark_case.graph_changes_percent_)
+		{
+			ChangeGraph(*changeable_objects, change_generator);
+		}
+
+		// Without the phase graph every phase is a frame of its own
+		const bool phase_graph = benchmark_case.UsesPhaseGraph();
+		const unsigned int num_passes = phase_graph ? 1 : benchmark_case.num_phases_;
+		bool hit = false;
+		for (unsigned int pass = 0; pass < num_passes; pass++)
+		{
+			hit = false;
+			if (benchmark_case.schedule_cache_)
+			{
+				measure(EPhase::ScheduleCache, [&]() { hit = scheduler.RestoreCachedSchedule(objects); });
+			}
+			if (!hit)
+			{
+				measure(EPhase::CreateClusters, [&]() { scheduler.CreateClusters(objects); });
+				measure(EPhase::CreateClustersDependencies, [&]() { scheduler.CreateClustersDependencies(); });
+				measure(EPhase::GenerateClusterGroups, [&]() { scheduler.GenerateClusterGroups(); });
+				if (benchmark_case.schedule_cache_)
+				{
+					measure(EPhase::ScheduleCache, [&]() { scheduler.StoreSchedule(); });
+				}
+			}
+			IF_TEST_STUFF(Cluster::Test_AreClustersCoherent(scheduler.GetClusters(), scheduler.GetNumClusters()));
+			result.num_clusters_ = scheduler.GetNumClusters();
+			result.num_groups_ = scheduler.GetNumGroups();
+			if (phase_graph)
+			{
+				measure(EPhase::Execution, [&]() { scheduler.ExecutePhases(benchmark_case.num_phases_); });
+			}
+			else
+			{
+				measure(EPhase::Execution, [&]() { scheduler.Execute(); });
+			}
+		}
+		if (churn)
+		{
+			measure(EPhase::ObjectChanges, [&]() { registry.ApplyPendingChanges(delete_short_lived); });
+		}
+
+		double scheduling_us = 0.0;
+		for (size_t phase_idx = 0; phase_idx < static_cast<size_t>(EPhase::Execution); phase_idx++)
+		{
+			scheduling_us += phase_us[phase_idx];
+		}
+		(hit ? hit_samples : miss_samples).push_back(scheduling_us);
+
+		if (i < 0)
+			continue;
+		num_hits += hit ? 1 : 0;
+		result.deadline_misses_ += scheduler.LastFrameMissedDeadline() ? 1 : 0;
+		num_deferred_clusters += scheduler.GetLastFrameDeferredClusters();
+		num_deferred_objects += scheduler.GetLastFrameDeferredObjects();
+		num_yielded_clusters += scheduler.GetLastFrameStats().Get(EStat::ClustersYielded);
+		num_inlined_groups += scheduler.GetLastFrameStats().Get(EStat::GroupsInlined);
+		num_cluster_batches += scheduler.GetLastFrameStats().Get(EStat::ClusterBatches);
+		double frame_us = 0.0;
+		for (size_t phase_idx = 0; phase_idx < static_cast<size_t>(EPhase::Count); phase_idx++)
+		{
+			phase_samples[phase_idx].push_back(phase_us[phase_idx]);
+			frame_us += phase_us[phase_idx];
+		}
+		frame_samples.push_back(frame_us);
+	}
+
+	result.frame_us_ = Statistics::From(frame_samples);
+	for (size_t phase_idx = 0; phase_idx < static_cast<size_t>(EPhase::Count); phase_idx++)
+	{
+		result.phase_us_[phase_idx] = Statistics::From(phase_samples[phase_idx]);
+	}
+	result.objects_per_second_ = (result.frame_us_.median_ > 0.0) ? (objects.size() * 1000000.0 / result.frame_us_.median_) : 0.0;
+	for (unsigned int idx = 0; idx < ClusteringPolicy::kNumAlgorithms; idx++)
+	{
+		result.adaptive_choices_[idx] = scheduler.GetClusteringPolicy().GetNumChoices(static_cast<EClusteringAlgorithm>(idx)) - choices_before[idx];
+	}
+	if (repeat > 0)
+	{
+		result.deferred_clusters_per_frame_ = static_cast<double>(num_deferred_clusters) / repeat;
+		result.deferred_objects_per_frame_ = static_cast<double>(num_deferred_objects) / repeat;
+		result.clusters_yielded_per_frame_ = static_cast<double>(num_yielded_clusters) / repeat;
+		result.groups_inlined_per_frame_ = static_cast<double>(num_inlined_groups) / repeat;
+		result.cluster_batches_per_frame_ = static_cast<double>(num_cluster_batches) / repeat;
+	}
+	result.inline_threshold_ = scheduler.GetInlineThreshold();
+	result.batch_threshold_ = scheduler.GetBatchThreshold();
+	scheduler.SetFrameBudget(0.0f);
+#if MTOBJECTS_COROUTINES
+	scheduler.SetTimeSlice(0.0f);
+#endif
+	scheduler.EnableGroupWorkerPool(true);
+	scheduler.EnableAdaptiveDispatch(true);
+	scheduler.SetPrefetchDistance(FrameScheduler::kDefaultPrefetchDistance);
+	if (churn)
+	{
+		registry.ApplyPendingChanges(delete_short_lived);
+		for (IThreadSafeObject* obj : registry.GetObjects())
+		{
+			if (static_cast<TestObject*>(obj)->short_lived_)
+			{
+				registry.Destroy(obj);
+			}
+		}
+		registry.ApplyPendingChanges(delete_short_lived);
+		for (TestObject* obj : *changeable_objects)
+		{
+			obj->registry_ = nullptr;
+			obj->spawns_ = false;
+		}
+	}
+	if (benchmark_case.schedule_cache_ && repeat > 0)
+	{
+		// The misses include the warmup frames, so there is a reference even if every measured frame hit.
+		result.schedule_cache_hit_rate_ = static_cast<double>(num_hits) / repeat;
+		const double saved_us_per_hit = Statistics::From(miss_samples).median_ - Statistics::From(hit_samples).median_;
+		result.schedule_cache_saved_us_per_frame_ = hit_samples.empty() ? 0.0 : saved_us_per_hit * result.schedule_cache_hit_rate_;
+	}
+	return result;
+}
+
+inline void WriteJson(std::ostream& out, const Statistics& statistics)
+{
+	out << "{\"median\": " << statistics.median_
+		<< ", \"p99\": " << statistics.p99_
+		<< ", \"mean\": " << statistics.mean_
+		<< ", \"min\": " << statistics.min_
+		<< ", \"max\": " << statistics.max_ << "}";
+}
+
+/*
+Median frames of the variants in a JSON results file, in their order. Used to compare against a build with
+MTOBJECTS_TELEMETRY=0 run with the same command line.
+*/
+inline vector<double> ReadFrameMedians(std::istream& in)
+{
+	static const char* const kKey = "\"frame_us\": {\"median\": ";
+	vector<double> medians;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		const size_t pos = line.find(kKey);
+		if (std::string::npos != pos)
+		{
+			medians.push_back(std::atof(line.c_str() + pos + std::strlen(kKey)));
+		}
+	}
+	return medians;
+}
+
+inline void WriteJson(std::ostream& out, const vector<BenchmarkResult>& results)
+{
+	out << "{" << std::endl;
+	out << "  \"backend\": \"" << Parallel::kBackendName << "\"," << std::endl;
+	out << "  \"pool\": \"" << ChunkMemoryPool::GetName() << "\"," << std::endl;
+	out << "  \"telemetry\": " << (MTOBJECTS_TELEMETRY ? "true" : "false") << "," << std::endl;
+	out << "  \"results\": [";
+	for (size_t result_idx = 0; result_idx < results.size(); result_idx++)
+	{
+		const BenchmarkResult& result = results[result_idx];
+		out << (result_idx ? "," : "") << std::endl << "    {";
+		out << "\"shape\": \"" << ToString(result.case_.shape_) << "\"";
+		out << ", \"objects\": " << result.case_.num_objects_;
+		out << ", \"forced_clusters\": " << result.case_.forced_clusters_;
+		out << ", \"dependencies\": " << result.case_.dependencies_num_;
+		out << ", \"const_dependencies\": " << result.case_.const_dependencies_num_;
+		out << ", \"const_locality\": " << result.case_.const_locality_;
+		out << ", \"threads\": " << result.num_threads_;
+		out << ", \"algorithm\": \"" << ToString(result.case_.algorithm_) << "\"";
+		out << ", \"schedule_cache\": " << (result.case_.schedule_cache_ ? "true" : "false");
+		out << ", \"group_worker_pool\": " << (result.case_.group_worker_pool_ ? "true" : "false");
+		out << ", \"adaptive_dispatch\": " << (result.case_.adaptive_dispatch_ ? "true" : "false");
+		out << ", \"graph_changes_percent\": " << result.case_.graph_changes_percent_;
+		out << ", \"critical_percent\": " << result.case_.critical_percent_;
+		out << ", \"low_percent\": " << result.case_.low_percent_;
+		out << ", \"task_work\": " << result.case_.task_work_;
+		out << ", \"frame_budget_us\": " << result.case_.frame_budget_us_;
+		out << ", \"heavy_percent\": " << result.case_.heavy_percent_;
+		out << ", \"time_slice_us\": " << result.case_.time_slice_us_;
+		out << ", \"phases\": " << result.case_.num_phases_;
+		out << ", \"phase_graph\": " << (result.case_.phase_graph_ ? "true" : "false");
+		out << ", \"churn_percent\": " << result.case_.churn_percent_;
+		out << ", \"task_memory\": " << result.case_.task_memory_;
+		out << ", \"prefetch_distance\": " << result.case_.prefetch_distance_;
+		out << ", \"repeat\": " << result.repeat_;
+		out << ", \"clusters\": " << result.num_clusters_;
+		out << ", \"groups\": " << result.num_groups_;
+		out << ", \"throughput_objects_per_s\": " << result.objects_per_second_;
+		if (EClusteringAlgorithm::Adaptive == result.case_.algorithm_)
+		{
+			out << ", \"adaptive_choices\": {";
+			for (unsigned int idx = 0; idx < ClusteringPolicy::kNumAlgorithms; idx++)
+			{
+				out << (idx ? ", " : "") << "\"" << ToString(static_cast<EClusteringAlgorithm>(idx)) << "\": " << result.adaptive_choices_[idx];
+			}
+			out << "}";
+		}
+		if (result.case_.frame_budget_us_ > 0.0f)
+		{
+			out << ", \"deadline_misses\": " << result.deadline_misses_;
+			out << ", \"deadline_miss_rate\": " << (result.repeat_ ? static_cast<double>(result.deadline_misses_) / result.repeat_ : 0.0);
+			out << ", \"deferred_clusters_per_frame\": " << result.deferred_clusters_per_frame_;
+			out << ", \"deferred_objects_per_frame\": " << result.deferred_objects_per_frame_;
+		}
+		if (result.case_.time_slice_us_ > 0.0f)
+		{
+			out << ", \"clusters_yielded_per_frame\": " << result.clusters_yielded_per_frame_;
+		}
+		if (result.case_.ReportsDispatch())
+		{
+			out << ", \"groups_inlined_per_frame\": " << result.groups_inlined_per_frame_;
+			out << ", \"cluster_batches_per_frame\": " << result.cluster_batches_per_frame_;
+			out << ", \"inline_threshold_objects\": " << result.inline_threshold_;
+			out << ", \"batch_threshold_objects\": " << result.batch_threshold_;
+		}
+		if (result.case_.schedule_cache_)
+		{
+			out << ", \"schedule_cache_hit_rate\": " << result.schedule_cache_hit_rate_;
+			out << ", \"schedule_cache_saved_us_per_frame\": " << result.schedule_cache_saved_us_per_frame_;
+		}
+		if (result.baseline_frame_us_ > 0.0)
+		{
+			out << ", \"telemetry_baseline_frame_us\": " << result.baseline_frame_us_;
+			out << ", \"telemetry_overhead_percent\": " << (result.frame_us_.median_ / result.baseline_frame_us_ - 1.0) * 100.0;
+		}
+		out << "," << std::endl << "      \"frame_us\": ";
+		WriteJson(out, result.frame_us_);
+		for (size_t phase_idx = 0; phase_idx < static_cast<size_t>(EPhase::Count); phase_idx++)
+		{
+			out << "," << std::endl << "      \"" << ToString(static_cast<EPhase>(phase_idx)) << "_us\": ";
+			WriteJson(out, result.phase_us_[phase_idx]);
+		}
+		out << "}";
+	}
+	out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+struct BarrierBenchmarkResult
+{
+	unsigned int num_threads_ = 0;
+	unsigned int num_groups_ = 0;
+	double pool_us_per_group_ = 0.0; // GroupWorkerPool, the whole frame published at once
+	double parallel_for_us_per_group_ = 0.0; // a Parallel::For per group, as ExecuteTier
+};
+
+/*
+Handoff latency between groups. Frames of num_groups groups with a cluster per thread and almost no work run on the
+GroupWorkerPool and as a Parallel::For per group. The median frame divided by the groups is the cost of a barrier and the wake-ups around it.
+*/
+inline vector<BarrierBenchmarkResult> RunBarrierBenchmark(const vector<int>& thread_counts, int warmup, int repeat)
+{
+	struct EmptyGroupsJob : public IPhasedJob
+	{
+		unsigned int num_groups_ = 0;
+		unsigned int group_size_ = 0;
+		std::atomic<unsigned int> num_runs_ = { 0 };
+
+		unsigned int GetNumPhases() const override { return num_groups_; }
+		unsigned int GetPhaseSize(unsigned int) const override { return group_size_; }
+		void Run(unsigned int, unsigned int) override { num_runs_.fetch_add(1, std::memory_order_relaxed); }
+	};
+
+	static const constexpr unsigned int kGroupCounts[] = { 1, 4, 16, 64, 256, 1024 };
+	vector<BarrierBenchmarkResult> results;
+	for (int num_threads : thread_counts)
+	{
+		Parallel::SetNumThreads(static_cast<unsigned int>(std::max(0, num_threads)));
+		for (unsigned int num_groups : kGroupCounts)
+		{
+			EmptyGroupsJob job;
+			job.num_groups_ = num_groups;
+			job.group_size_ = Parallel::NumThreads();
+			vector<double> pool_samples;
+			vector<double> parallel_for_samples;
+			for (int i = -warmup; i < repeat; i++)
+			{
+				const auto time_0 = std::chrono::steady_clock::now();
+				GroupWorkerPool::Get().Run(job);
+				const auto time_1 = std::chrono::steady_clock::now();
+				for (unsigned int group_idx = 0; group_idx < num_groups; group_idx++)
+				{
+					Parallel::For<unsigned int>(0, job.group_size_, [&job, group_idx](unsigned int idx) { job.Run(group_idx, idx); });
+				}
+				const auto time_2 = std::chrono::steady_clock::now();
+				if (i < 0)
+					continue;
+				pool_samples.push_back(std::chrono::duration<double, std::micro>(time_1 - time_0).count());
+				parallel_for_samples.push_back(std::chrono::duration<double, std::micro>(time_2 - time_1).count());
+			}
+			Assert(job.num_runs_ == 2ull * (warmup + repeat) * num_groups * job.group_size_);
+			BarrierBenchmarkResult result;
+			result.num_threads_ = Parallel::NumThreads();
+			result.num_groups_ = num_groups;
+			result.pool_us_per_group_ = Statistics::From(pool_samples).median_ / num_groups;
+			result.parallel_for_us_per_group_ = Statistics::From(parallel_for_samples).median_ / num_groups;
+			results.push_back(result);
+		}
+	}
+	return results;
+}
+
+inline void WriteJson(std::ostream& out, const vector<BarrierBenchmarkResult>& results)
+{
+	out << "{" << std::endl;
+	out << "  \"backend\": \"" << Parallel::kBackendName << "\"," << std::endl;
+	out << "  \"spin_count\": " << GroupWorkerPool::Get().GetSpinCount() << "," << std::endl;
+	out << "  \"barrier_results\": [";
+	for (size_t result_idx = 0; result_idx < results.size(); result_idx++)
+	{
+		const BarrierBenchmarkResult& result = results[result_idx];
+		out << (result_idx ? "," : "") << std::endl << "    {";
+		out << "\"threads\": " << result.num_threads_;
+		out << ", \"groups\": " << result.num_groups_;
+		out << ", \"pool_us_per_group\": " << result.pool_us_per_group_;
+		out << ", \"parallel_for_us_per_group\": " << result.parallel_for_us_per_group_ << "}";
+	}
+	out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+/*
+Executes one frame of the objects and simulates it for ScheduleSimulator::GetDefaultWorkerCounts. Measured costs are the
+cluster times of that frame in ns and the barrier of the group worker pool costs the measured DispatchCost::phase_ns_
+(0 if not calibrated), estimated costs are in GetCost units without a barrier cost.
+*/
+inline ScheduleSimulation SimulateSchedule(const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, bool measured_costs)
+{
+	scheduler.CreateClusters(all_objects);
+	scheduler.CreateClustersDependencies();
+	scheduler.GenerateClusterGroups();
+	ScheduleSimulator simulator;
+	simulator.Build(scheduler);
+	if (!measured_costs)
+	{
+		simulator.SetClusterCosts(ScheduleSimulator::EstimateClusterCosts(scheduler));
+	}
+	scheduler.EnableClusterTiming(measured_costs);
+	scheduler.Execute();
+	scheduler.EnableClusterTiming(false);
+	if (measured_costs)
+	{
+		simulator.SetClusterCosts(ScheduleSimulator::GetMeasuredClusterCosts(scheduler));
+	}
+	const double barrier_cost = measured_costs ? scheduler.GetDispatchCost().phase_ns_ : 0.0;
+	return simulator.Simulate(ScheduleSimulator::GetDefaultWorkerCounts(), barrier_cost);
+}
+
+inline void WriteJson(std::ostream& out, const ScheduleSimulation& simulation, bool measured_costs)
+{
+	out << "{" << std::endl;
+	out << "  \"cost_unit\": \"" << (measured_costs ? "ns" : "cost") << "\"," << std::endl;
+	out << "  \"clusters\": " << simulation.num_clusters_ << "," << std::endl;
+	out << "  \"steps\": " << simulation.steps_.size() << "," << std::endl;
+	out << "  \"total_work\": " << simulation.total_work_ << "," << std::endl;
+	out << "  \"barrier_cost\": " << simulation.barrier_cost_ << "," << std::endl;
+	out << "  \"groups_critical_path\": " << simulation.groups_critical_path_ << "," << std::endl;
+	out << "  \"graph_critical_path\": " << simulation.graph_critical_path_ << "," << std::endl;
+	out << "  \"groups_speedup_ceiling\": " << simulation.GetGroupsSpeedupCeiling() << "," << std::endl;
+	out << "  \"graph_speedup_ceiling\": " << simulation.GetGraphSpeedupCeiling() << "," << std::endl;
+	out << "  \"critical_chain\": [";
+	for (size_t idx = 0; idx < simulation.critical_chain_.size(); idx++)
+	{
+		out << (idx ? ", " : "") << simulation.critical_chain_[idx];
+	}
+	out << "]," << std::endl;
+	out << "  \"step_list\": [";
+	for (size_t step_idx = 0; step_idx < simulation.steps_.size(); step_idx++)
+	{
+		const SimulatedStep& step = simulation.steps_[step_idx];
+		out << (step_idx ? "," : "") << std::endl << "    {\"group\": " << step.group_ << ", \"tier\": \"" << ToString(step.tier_) << "\""
+			<< ", \"clusters\": " << step.num_clusters_ << ", \"work\": " << step.work_ << ", \"max_cluster\": " << step.max_cluster_ << "}";
+	}
+	out << std::endl << "  ]," << std::endl;
+	out << "  \"workers\": [";
+	for (size_t workers_idx = 0; workers_idx < simulation.workers_.size(); workers_idx++)
+	{
+		const SimulatedWorkers& workers = simulation.workers_[workers_idx];
+		out << (workers_idx ? "," : "") << std::endl << "    {\"workers\": " << workers.num_workers_;
+		out << ", \"groups_makespan\": " << workers.groups_makespan_;
+		out << ", \"graph_makespan\": " << workers.graph_makespan_;
+		out << ", \"groups_speedup\": " << workers.groups_speedup_;
+		out << ", \"graph_speedup\": " << workers.graph_speedup_;
+		out << ", \"utilization\": " << workers.utilization_;
+		out << ", \"step_utilization\": [";
+		for (size_t step_idx = 0; step_idx < workers.step_utilization_.size(); step_idx++)
+		{
+			out << (step_idx ? ", " : "") << workers.step_utilization_[step_idx];
+		}
+		out << "]}";
+	}
+	out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Utils.h"
+#include <bitset>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MTOBJECTS_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MTOBJECTS_SIMD_SSE2 1
+#endif
+
+namespace MTObjects
+{
+	namespace BitMatrixStuff
+	{
+		/*
+		Word word_idx (bits [64 * word_idx, 64 * word_idx + 64)) of a bitset. Both the MSVC and the GNU bitset keep the bits
+		in an array of little endian words, so the object representation is read directly instead of shifting the whole set.
+		*/
+		template<size_t kBits> uint64_t GetWord(const std::bitset<kBits>& set, unsigned int word_idx)
+		{
+			static_assert(0 == kBits % 64 && sizeof(std::bitset<kBits>) == kBits / 8, "unexpected bitset layout");
+			uint64_t word;
+			std::memcpy(&word, reinterpret_cast<const char*>(&set) + word_idx * sizeof(uint64_t), sizeof(uint64_t));
+			return word;
+		}
+
+		// Calls function(bit) for every set bit in [begin, end), in increasing order.
+		template<size_t kBits, typename TFunction> void ForEachSetBit(const std::bitset<kBits>& set, unsigned int begin, unsigned int end, const TFunction& function)
+		{
+			for (unsigned int word_idx = begin / 64; word_idx * 64 < end; word_idx++)
+			{
+				uint64_t word = GetWord(set, word_idx);
+				if (word_idx == begin / 64)
+				{
+					word &= ~0ull << (begin % 64);
+				}
+				if (end < word_idx * 64 + 64)
+				{
+					word &= (1ull << (end % 64)) - 1;
+				}
+				unsigned long bit = 0;
+				while (BitScanForward64(bit, word))
+				{
+					function(static_cast<unsigned int>(word_idx * 64 + bit));
+					word &= word - 1;
+				}
+			}
+		}
+
+		// Index of the first zero bit in [begin, end), end if there is none. Fully set words are skipped a SIMD register at a time.
+		inline unsigned int FindFirstZero(const uint64_t* words, unsigned int begin, unsigned int end)
+		{
+			if (begin >= end)
+				return end;
+			unsigned int word_idx = begin / 64;
+			const unsigned int end_word = (end + 63) / 64;
+			unsigned long bit = 0;
+			if (begin % 64)
+			{
+				if (BitScanForward64(bit, ~words[word_idx] & (~0ull << (begin % 64))))
+					return std::min(end, static_cast<unsigned int>(word_idx * 64 + bit));
+				word_idx++;
+			}
+#if MTOBJECTS_SIMD_AVX2
+			const __m256i all_ones = _mm256_set1_epi64x(-1);
+			while (word_idx + 4 <= end_word && _mm256_testc_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + word_idx)), all_ones))
+			{
+				word_idx += 4;
+			}
+#elif MTOBJECTS_SIMD_SSE2
+			const __m128i all_ones = _mm_set1_epi32(-1);
+			while (word_idx + 2 <= end_word
+				&& 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words + word_idx)), all_ones)))
+			{
+				word_idx += 2;
+			}
+#endif
+			for (; word_idx < end_word; word_idx++)
+			{
+				if (BitScanForward64(bit, ~words[word_idx]))
+					return std::min(end, static_cast<unsigned int>(word_idx * 64 + bit));
+			}
+			return end;
+		}
+	}
+
+	/*
+	Dense kRows x kColumns bit matrix, rows are 32 byte aligned. Nothing is cleared implicitly: a user that grows the number of
+	columns clears the new words with ClearWord, so a frame touches only the words it uses.
+	*/
+	template<unsigned int kRows, unsigned int kColumns>
+	class BitMatrix
+	{
+	public:
+		static const constexpr unsigned int kWordsPerRow = kColumns / 64;
+		static_assert(0 == kColumns % 256, "rows are made of whole 256 bit blocks");
+
+	private:
+		struct alignas(32) Row
+		{
+			uint64_t words_[kWordsPerRow];
+		};
+		std::unique_ptr<Row[]> rows_;
+
+	public:
+		BitMatrix() : rows_(new Row[kRows]()) {}
+		BitMatrix(const BitMatrix&) = delete;
+		BitMatrix& operator=(const BitMatrix&) = delete;
+
+		// Clears the 64 columns word containing column, in rows [begin_row, end_row).
+		void ClearWord(unsigned int column, unsigned int begin_row, unsigned int end_row)
+		{
+			Assert(column < kColumns && end_row <= kRows);
+			for (unsigned int row = begin_row; row < end_row; row++)
+			{
+				rows_[row].words_[column / 64] = 0;
+			}
+		}
+
+		void Set(unsigned int row, unsigned int column)
+		{
+			Assert(row < kRows && column < kColumns);
+			rows_[row].words_[column / 64] |= 1ull << (column % 64);
+		}
+
+		bool Get(unsigned int row, unsigned int column) const
+		{
+			Assert(row < kRows && column < kColumns);
+			return 0 != (rows_[row].words_[column / 64] & (1ull << (column % 64)));
+		}
+
+		// First zero column of the row in [0, num_columns), searched from first_column and wrapping around. num_columns if the row is full.
+		unsigned int FindFirstZero(unsigned int row, unsigned int num_columns, unsigned int first_column) const
+		{
+			Assert(row < kRows && num_columns <= kColumns && (first_column < num_columns || 0 == num_columns));
+			const uint64_t* words = rows_[row].words_;
+			const unsigned int found = BitMatrixStuff::FindFirstZero(words, first_column, num_columns);
+			if (found != num_columns)
+				return found;
+			const unsigned int wrapped = BitMatrixStuff::FindFirstZero(words, 0, first_column);
+			return (wrapped != first_column) ? wrapped : num_columns;
+		}
+	};
+}
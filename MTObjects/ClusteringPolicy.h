@@ -0,0 +1,269 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include <array>
+#include <ostream>
+#include <cstdint>
+
+namespace MTObjects
+{
+	enum class EClusteringAlgorithm : unsigned char
+	{
+		Default,		// Cluster::CreateClusters
+		Experimental,	// Cluster::CreateClusters_Experimental
+		Batched,		// Cluster::CreateClusters_Batched
+		Adaptive,		// chosen every frame by ClusteringPolicy
+		Count
+	};
+
+	inline const char* ToString(EClusteringAlgorithm algorithm)
+	{
+		switch (algorithm)
+		{
+		case EClusteringAlgorithm::Default: return "CreateClusters";
+		case EClusteringAlgorithm::Experimental: return "CreateClusters_Experimental";
+		case EClusteringAlgorithm::Batched: return "CreateClusters_Batched";
+		case EClusteringAlgorithm::Adaptive: return "Adaptive";
+		default: return "unknown";
+		}
+	}
+
+	enum class EDecisionReason : unsigned char
+	{
+		OnlyAvailable,	// the other algorithm is not available
+		Exploring,		// no measurement for this kind of graph yet
+		Reprobing,		// periodic re-measurement of the slower algorithm
+		Fastest,		// the lowest estimated time
+		Count
+	};
+
+	inline const char* ToString(EDecisionReason reason)
+	{
+		switch (reason)
+		{
+		case EDecisionReason::OnlyAvailable: return "only_available";
+		case EDecisionReason::Exploring: return "exploring";
+		case EDecisionReason::Reprobing: return "reprobing";
+		case EDecisionReason::Fastest: return "fastest";
+		default: return "unknown";
+		}
+	}
+
+	// Cheap statistics of the graph: a few sampled objects and the counters of the previous frame.
+	struct GraphSample
+	{
+		uint32_t num_objects_ = 0;
+		float average_degree_ = 0.0f;
+		uint32_t max_degree_ = 0;
+		uint32_t previous_clusters_ = 0;
+		uint32_t previous_merges_ = 0;
+	};
+
+	struct ClusteringDecision
+	{
+		static const constexpr unsigned int kNumAlgorithms = static_cast<unsigned int>(EClusteringAlgorithm::Adaptive);
+
+		uint64_t frame_ = 0;
+		GraphSample sample_;
+		EClusteringAlgorithm algorithm_ = EClusteringAlgorithm::Default;
+		EDecisionReason reason_ = EDecisionReason::Fastest;
+		std::array<float, kNumAlgorithms> estimated_ns_per_object_ = {};	// < 0 - unknown
+		float measured_us_ = -1.0f;
+	};
+
+	/*
+	Picks the clustering algorithm of a frame. Graphs are bucketed by the sampled degree and the previous cluster count,
+	every bucket keeps a smoothed cost (ns per object) of each algorithm. An unmeasured algorithm is tried first, the slower one
+	is re-measured every kReprobeInterval decisions, otherwise the cheaper one wins.
+	The last kLogCapacity decisions are kept for auditing (WriteLog). Nothing is allocated after the construction.
+	*/
+	class ClusteringPolicy
+	{
+	public:
+		static const constexpr unsigned int kNumAlgorithms = ClusteringDecision::kNumAlgorithms;
+		static const constexpr unsigned int kDegreeSamples = 64;
+		static const constexpr unsigned int kNumDegreeBuckets = 8;
+		static const constexpr unsigned int kNumClusterBuckets = 8;
+		static const constexpr unsigned int kReprobeInterval = 64;
+		static const constexpr unsigned int kLogCapacity = 1024;
+		static const constexpr float kSmoothing = 0.25f;
+
+	private:
+		struct Bucket
+		{
+			std::array<float, kNumAlgorithms> estimated_ns_per_object_;
+			unsigned int decisions_since_probe_ = 0;
+
+			Bucket() { estimated_ns_per_object_.fill(-1.0f); }
+		};
+
+		std::array<Bucket, kNumDegreeBuckets * kNumClusterBuckets> buckets_;
+		std::array<bool, kNumAlgorithms> enabled_;
+		std::array<uint64_t, kNumAlgorithms> num_choices_ = {};
+		std::array<ClusteringDecision, kLogCapacity> log_;
+		uint64_t num_decisions_ = 0;
+		unsigned int last_bucket_ = 0;
+
+		static unsigned int Log2Bucket(uint32_t value, unsigned int num_buckets)
+		{
+			unsigned int bucket = 0;
+			while (value > 1 && bucket + 1 < num_buckets)
+			{
+				value >>= 1;
+				bucket++;
+			}
+			return bucket;
+		}
+
+		ClusteringDecision& LastDecision() { return log_[(num_decisions_ - 1) % kLogCapacity]; }
+
+	public:
+		ClusteringPolicy()
+		{
+			enabled_.fill(true);
+		}
+
+		bool IsAvailable(EClusteringAlgorithm algorithm) const
+		{
+			const unsigned int idx = static_cast<unsigned int>(algorithm);
+			return idx < kNumAlgorithms && enabled_[idx];
+		}
+
+		void SetEnabled(EClusteringAlgorithm algorithm, bool enabled)
+		{
+			Assert(static_cast<unsigned int>(algorithm) < kNumAlgorithms);
+			enabled_[static_cast<unsigned int>(algorithm)] = enabled;
+		}
+
+		// The pool is used only for a temporary container.
+		static GraphSample Sample(const vector<IThreadSafeObject*>& all_objects, const FrameStats& previous_frame, ChunkMemoryPool& pool)
+		{
+			GraphSample sample;
+			sample.num_objects_ = static_cast<uint32_t>(all_objects.size());
+			sample.previous_clusters_ = static_cast<uint32_t>(previous_frame.Get(EStat::ClustersCreated));
+			sample.previous_merges_ = static_cast<uint32_t>(previous_frame.Get(EStat::ClusterMerges));
+			if (all_objects.empty())
+				return sample;
+
+			FastContainer<IThreadSafeObject*> dependencies(pool);
+			const size_t num_samples = std::min<size_t>(kDegreeSamples, all_objects.size());
+			const size_t stride = all_objects.size() / num_samples;
+			uint64_t sum_degree = 0;
+			for (size_t sample_idx = 0; sample_idx < num_samples; sample_idx++)
+			{
+				all_objects[sample_idx * stride]->IsDependentOn(dependencies);
+				const uint32_t degree = dependencies.size();
+				sum_degree += degree;
+				sample.max_degree_ = std::max(sample.max_degree_, degree);
+				dependencies.clear<false>();
+			}
+			sample.average_degree_ = static_cast<float>(sum_degree) / num_samples;
+			return sample;
+		}
+
+		EClusteringAlgorithm Choose(const vector<IThreadSafeObject*>& all_objects, const FrameStats& previous_frame, ChunkMemoryPool& pool)
+		{
+			ClusteringDecision& decision = log_[num_decisions_ % kLogCapacity];
+			decision = ClusteringDecision();
+			decision.frame_ = num_decisions_;
+			num_decisions_++;
+			decision.sample_ = Sample(all_objects, previous_frame, pool);
+
+			last_bucket_ = Log2Bucket(static_cast<uint32_t>(decision.sample_.average_degree_ + 0.5f), kNumDegreeBuckets) * kNumClusterBuckets
+				+ Log2Bucket(decision.sample_.previous_clusters_, kNumClusterBuckets);
+			Bucket& bucket = buckets_[last_bucket_];
+			decision.estimated_ns_per_object_ = bucket.estimated_ns_per_object_;
+
+			unsigned int num_available = 0;
+			unsigned int fastest = kNumAlgorithms;
+			unsigned int slowest = kNumAlgorithms;
+			unsigned int unmeasured = kNumAlgorithms;
+			for (unsigned int idx = 0; idx < kNumAlgorithms; idx++)
+			{
+				if (!IsAvailable(static_cast<EClusteringAlgorithm>(idx)))
+					continue;
+				num_available++;
+				const float estimated = bucket.estimated_ns_per_object_[idx];
+				if (estimated < 0.0f)
+				{
+					unmeasured = (kNumAlgorithms == unmeasured) ? idx : unmeasured;
+					continue;
+				}
+				fastest = (kNumAlgorithms == fastest || estimated < bucket.estimated_ns_per_object_[fastest]) ? idx : fastest;
+				slowest = (kNumAlgorithms == slowest || estimated > bucket.estimated_ns_per_object_[slowest]) ? idx : slowest;
+			}
+
+			unsigned int chosen = 0;
+			if (num_available <= 1)
+			{
+				chosen = (kNumAlgorithms != unmeasured) ? unmeasured : ((kNumAlgorithms != fastest) ? fastest : 0);
+				decision.reason_ = EDecisionReason::OnlyAvailable;
+			}
+			else if (kNumAlgorithms != unmeasured)
+			{
+				chosen = unmeasured;
+				decision.reason_ = EDecisionReason::Exploring;
+			}
+			else if (++bucket.decisions_since_probe_ >= kReprobeInterval && slowest != fastest)
+			{
+				bucket.decisions_since_probe_ = 0;
+				chosen = slowest;
+				decision.reason_ = EDecisionReason::Reprobing;
+			}
+			else
+			{
+				chosen = fastest;
+				decision.reason_ = EDecisionReason::Fastest;
+			}
+
+			decision.algorithm_ = static_cast<EClusteringAlgorithm>(chosen);
+			num_choices_[chosen]++;
+			return decision.algorithm_;
+		}
+
+		// Measured time of the algorithm returned by the last Choose.
+		void Report(float measured_us)
+		{
+			Assert(num_decisions_ > 0);
+			ClusteringDecision& decision = LastDecision();
+			decision.measured_us_ = measured_us;
+			const float ns_per_object = 1000.0f * measured_us / std::max<uint32_t>(1, decision.sample_.num_objects_);
+			float& estimated = buckets_[last_bucket_].estimated_ns_per_object_[static_cast<unsigned int>(decision.algorithm_)];
+			estimated = (estimated < 0.0f) ? ns_per_object : (estimated + kSmoothing * (ns_per_object - estimated));
+		}
+
+		uint64_t GetNumDecisions() const { return num_decisions_; }
+		uint64_t GetNumChoices(EClusteringAlgorithm algorithm) const { return num_choices_[static_cast<unsigned int>(algorithm)]; }
+
+		// One JSON object per line, the oldest kept decision first.
+		void WriteLog(std::ostream& out) const
+		{
+			const uint64_t first = (num_decisions_ > kLogCapacity) ? (num_decisions_ - kLogCapacity) : 0;
+			for (uint64_t decision_idx = first; decision_idx < num_decisions_; decision_idx++)
+			{
+				const ClusteringDecision& decision = log_[decision_idx % kLogCapacity];
+				out << "{\"frame\": " << decision.frame_
+					<< ", \"algorithm\": \"" << ToString(decision.algorithm_) << "\""
+					<< ", \"reason\": \"" << ToString(decision.reason_) << "\""
+					<< ", \"objects\": " << decision.sample_.num_objects_
+					<< ", \"average_degree\": " << decision.sample_.average_degree_
+					<< ", \"max_degree\": " << decision.sample_.max_degree_
+					<< ", \"previous_clusters\": " << decision.sample_.previous_clusters_
+					<< ", \"previous_merges\": " << decision.sample_.previous_merges_
+					<< ", \"estimated_ns_per_object\": [";
+				for (unsigned int idx = 0; idx < kNumAlgorithms; idx++)
+				{
+					out << (idx ? ", " : "") << decision.estimated_ns_per_object_[idx];
+				}
+				out << "], \"measured_us\": " << decision.measured_us_ << "}" << std::endl;
+			}
+		}
+
+		void Reset()
+		{
+			buckets_.fill(Bucket());
+			num_choices_.fill(0);
+			num_decisions_ = 0;
+		}
+	};
+}
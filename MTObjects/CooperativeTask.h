@@ -0,0 +1,186 @@
+#pragma once
+
+/*
+Optional cooperative tasks, C++20 coroutines. An object that opts in implements IThreadSafeObject::RunCooperative and may
+co_await CooperativeStuff::Yield() at convenient points. A yield suspends the task only when the time slice of the current
+worker ran out, otherwise it costs a clock read. Without coroutine support (e.g. -std=c++17) or with -DMTOBJECTS_COROUTINES=0
+MTOBJECTS_COROUTINES is 0 and everything in this file compiles out.
+*/
+#ifndef MTOBJECTS_COROUTINES
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define MTOBJECTS_COROUTINES 1
+#else
+#define MTOBJECTS_COROUTINES 0
+#endif
+#endif
+
+#if MTOBJECTS_COROUTINES
+#include <coroutine>
+#include <chrono>
+#include <array>
+#include <new>
+#include <utility>
+#include "Utils.h"
+
+namespace MTObjects
+{
+	namespace CooperativeStuff
+	{
+		/*
+		Coroutine frames recycled per thread in size classes of kGranularity bytes, so the steady state doesn't touch the heap.
+		A frame released on another thread than the one that allocated it goes to the releasing thread's list.
+		*/
+		class FrameAllocator
+		{
+			static const constexpr size_t kGranularity = 64;
+			static const constexpr size_t kNumClasses = 16;
+
+			struct FreeBlock
+			{
+				FreeBlock* next_;
+			};
+
+			struct FreeLists
+			{
+				std::array<FreeBlock*, kNumClasses> heads_ = {};
+
+				~FreeLists()
+				{
+					for (FreeBlock* head : heads_)
+					{
+						while (head)
+						{
+							FreeBlock* next = head->next_;
+							::operator delete(head);
+							head = next;
+						}
+					}
+				}
+			};
+
+			static FreeLists& GetFreeLists()
+			{
+				static thread_local FreeLists free_lists;
+				return free_lists;
+			}
+
+			static size_t SizeClass(size_t size) { return (std::max<size_t>(size, 1) - 1) / kGranularity; }
+
+		public:
+			static void* Allocate(size_t size)
+			{
+				const size_t size_class = SizeClass(size);
+				if (size_class >= kNumClasses)
+					return ::operator new(size);
+				FreeBlock*& head = GetFreeLists().heads_[size_class];
+				if (!head)
+					return ::operator new((size_class + 1) * kGranularity);
+				FreeBlock* block = head;
+				head = block->next_;
+				return block;
+			}
+
+			static void Release(void* ptr, size_t size)
+			{
+				const size_t size_class = SizeClass(size);
+				if (size_class >= kNumClasses)
+				{
+					::operator delete(ptr);
+					return;
+				}
+				FreeBlock*& head = GetFreeLists().heads_[size_class];
+				head = new (ptr) FreeBlock{ head };
+			}
+		};
+
+		// End of the time slice of the calling worker, max() - the tasks of this thread run to completion.
+		inline std::chrono::steady_clock::time_point& SliceEnd()
+		{
+			static thread_local std::chrono::steady_clock::time_point slice_end = std::chrono::steady_clock::time_point::max();
+			return slice_end;
+		}
+
+		inline bool SliceExpired()
+		{
+			const std::chrono::steady_clock::time_point slice_end = SliceEnd();
+			return slice_end != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= slice_end;
+		}
+
+		struct YieldPoint
+		{
+			bool await_ready() const noexcept { return !SliceExpired(); }
+			void await_suspend(std::coroutine_handle<>) const noexcept {}
+			void await_resume() const noexcept {}
+		};
+
+		// co_await Yield() - suspends the task if the worker's time slice is used up.
+		inline YieldPoint Yield() { return {}; }
+	}
+
+	/*
+	Handle of a cooperative task. The task starts eagerly, runs until its first suspension and is destroyed with the handle.
+	Exceptions propagate to the caller of the call or the Resume that threw.
+	*/
+	class CooperativeTask
+	{
+	public:
+		struct promise_type
+		{
+			CooperativeTask get_return_object() { return CooperativeTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { throw; }
+
+			static void* operator new(size_t size) { return CooperativeStuff::FrameAllocator::Allocate(size); }
+			static void operator delete(void* ptr, size_t size) { CooperativeStuff::FrameAllocator::Release(ptr, size); }
+		};
+
+	private:
+		std::coroutine_handle<promise_type> handle_;
+
+		explicit CooperativeTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+	public:
+		CooperativeTask() = default;
+		CooperativeTask(CooperativeTask&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+		CooperativeTask& operator=(CooperativeTask&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Reset();
+				handle_ = std::exchange(other.handle_, nullptr);
+			}
+			return *this;
+		}
+		CooperativeTask(const CooperativeTask&) = delete;
+		CooperativeTask& operator=(const CooperativeTask&) = delete;
+		~CooperativeTask() { Reset(); }
+
+		bool IsDone() const { return !handle_ || handle_.done(); }
+
+		void Resume()
+		{
+			Assert(!IsDone());
+			handle_.resume();
+		}
+
+		void RunToCompletion()
+		{
+			while (!IsDone())
+			{
+				handle_.resume();
+			}
+		}
+
+		void Reset()
+		{
+			if (handle_)
+			{
+				handle_.destroy();
+				handle_ = nullptr;
+			}
+		}
+	};
+}
+#endif //MTOBJECTS_COROUTINES
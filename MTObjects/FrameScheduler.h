@@ -0,0 +1,419 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include "ScheduleCache.h"
+#include "ClusteringPolicy.h"
+#include "PhaseGraph.h"
+#include <chrono>
+
+namespace MTObjects
+{
+/*
+FrameScheduler is a persistent per-world scheduler. It owns the context (pool and clusters) and all the buffers
+needed by the phases of a frame, and reuses them from frame to frame. Everything is reserved upfront, so the
+scheduling phases don't touch the heap at all.
+*/
+class FrameScheduler
+{
+public:
+	static const constexpr unsigned int kDefaultPrefetchDistance = 0; // off, see SetPrefetchDistance
+
+private:
+	SchedulerContext context_;
+	vector<IndexSet> dependency_sets_;
+	vector<EPriority> cluster_priorities_;
+	ClusterDependenciesBuffers dependency_buffers_;
+	ClusterLabelBuffers label_buffers_;
+	vector<GroupOfConcurrentClusters> groups_;
+	ClusterGroupsBuffers group_buffers_;
+	GroupWorkList group_work_list_;
+	PhaseGraph phase_graph_;
+	unsigned int num_clusters_ = 0;
+	unsigned int num_groups_ = 0;
+	EClusteringAlgorithm clustering_algorithm_ = EClusteringAlgorithm::Default;
+	ClusteringPolicy clustering_policy_;
+	FrameStats last_frame_stats_;
+	FrameStats frame_start_stats_;
+	ScheduleCache schedule_cache_;
+	bool use_schedule_cache_ = false;
+	bool use_group_worker_pool_ = true;
+	bool adaptive_dispatch_ = true;
+	DispatchCost dispatch_cost_;
+	float object_cost_ns_ = -1.0f; // smoothed Execute time per object and thread, < 0 - not measured yet
+	unsigned int inline_threshold_ = 0;
+	unsigned int batch_threshold_ = 0;
+	unsigned int prefetch_distance_ = kDefaultPrefetchDistance;
+	bool cluster_timing_ = false;
+	vector<float> cluster_times_; // [ns] per cluster of the last Execute, see EnableClusterTiming
+	uint64_t schedule_key_ = 0;
+	size_t schedule_num_objects_ = 0;
+	float frame_budget_us_ = 0.0f; // 0 - no deadline
+	EPriority min_deferrable_ = EPriority::Low;
+	FrameDeadline deadline_;
+	bool frame_started_ = false;
+	bool last_frame_missed_deadline_ = false;
+	unsigned int last_frame_deferred_clusters_ = 0;
+	unsigned int last_frame_deferred_objects_ = 0;
+#if MTOBJECTS_COROUTINES
+	CooperativeBuffers cooperative_buffers_;
+	float time_slice_us_ = 0.0f; // 0 - clusters run to completion
+#endif
+
+	// The first phase of a frame (RestoreCachedSchedule or CreateClusters) starts the frame budget.
+	void StartFrame()
+	{
+		if (frame_started_)
+			return;
+		frame_started_ = true;
+		frame_start_stats_ = Telemetry::Collect();
+		Telemetry::ResetThreadMaxima();
+		deadline_.enabled_ = frame_budget_us_ > 0.0f;
+		deadline_.min_deferrable_ = min_deferrable_;
+		deadline_.deadline_ = std::chrono::steady_clock::now()
+			+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float, std::micro>(frame_budget_us_));
+		deadline_.num_deferred_clusters_ = 0;
+		deadline_.num_deferred_objects_ = 0;
+	}
+
+	/*
+	Thresholds of the GroupWorkList, in objects: a tier that costs less than a handoff between phases runs inline, a batch
+	should cost more than the claim of an index. The dispatch cost comes from Calibrate, the cost of an object from the
+	previous frames. Until both are known for the current thread count nothing is inlined or batched.
+	*/
+	void UpdateDispatchThresholds(unsigned int num_threads)
+	{
+		static const constexpr float kMaxThreshold = 1 << 24;
+		if (!adaptive_dispatch_ || dispatch_cost_.num_threads_ != num_threads)
+		{
+			inline_threshold_ = 0;
+			batch_threshold_ = 0;
+			return;
+		}
+		const bool known = object_cost_ns_ > 0.0f;
+		inline_threshold_ = known ? static_cast<unsigned int>(std::min(dispatch_cost_.phase_ns_ / object_cost_ns_, kMaxThreshold)) : 0;
+		batch_threshold_ = known ? static_cast<unsigned int>(std::min(dispatch_cost_.index_ns_ / object_cost_ns_, kMaxThreshold)) : 0;
+	}
+
+	void ReportExecuteTime(float execute_ns, unsigned int num_threads, unsigned int num_objects)
+	{
+		static const constexpr float kSmoothing = 0.25f;
+		if (!num_objects)
+			return;
+		const float sample = execute_ns * num_threads / num_objects;
+		object_cost_ns_ = (object_cost_ns_ < 0.0f) ? sample : (object_cost_ns_ + kSmoothing * (sample - object_cost_ns_));
+	}
+
+	void FinishFrame()
+	{
+		last_frame_missed_deadline_ = deadline_.HasPassed();
+		last_frame_deferred_clusters_ = deadline_.num_deferred_clusters_;
+		last_frame_deferred_objects_ = deadline_.num_deferred_objects_;
+		IF_TELEMETRY(Telemetry::Add(EStat::DeadlineMisses, last_frame_missed_deadline_ ? 1 : 0));
+		frame_started_ = false;
+		num_clusters_ = 0;
+		num_groups_ = 0;
+		CollectFrameStats();
+	}
+
+	void CollectFrameStats()
+	{
+		last_frame_stats_ = Telemetry::Collect();
+		last_frame_stats_.SubtractCounters(frame_start_stats_);
+		Telemetry::CollectThreadMaxima(last_frame_stats_);
+		last_frame_stats_.chunks_in_use_ = context_.pool_.GetNumChunksAllocated();
+		last_frame_stats_.max_chunks_in_use_ = context_.pool_.GetMaxNumChunksAllocated();
+		last_frame_stats_.chunks_capacity_ = ChunkMemoryPool::kNumberChunks;
+		context_.pool_.ResetMaxNumChunksAllocated();
+	}
+
+public:
+	explicit FrameScheduler(SmartStackStuff::EPageBacking backing = SmartStackStuff::EPageBacking::Default)
+		: context_(backing)
+	{
+		dependency_sets_.reserve(kMaxClusters);
+		cluster_priorities_.reserve(kMaxClusters);
+		// There is at most one group per cluster
+		groups_.resize(kMaxClusters);
+	}
+	~FrameScheduler() = default;
+	FrameScheduler(const FrameScheduler&) = delete;
+	FrameScheduler& operator=(const FrameScheduler&) = delete;
+
+	unsigned int CreateClusters(const vector<IThreadSafeObject*>& all_objects)
+	{
+		MTO_TRACE_SCOPE("CreateClusters");
+		StartFrame();
+		const bool adaptive = (EClusteringAlgorithm::Adaptive == clustering_algorithm_);
+		const EClusteringAlgorithm algorithm = adaptive ? clustering_policy_.Choose(all_objects, last_frame_stats_, context_.pool_) : clustering_algorithm_;
+		const auto time_0 = std::chrono::steady_clock::now();
+		switch (algorithm)
+		{
+		case EClusteringAlgorithm::Experimental: num_clusters_ = Cluster::CreateClusters_Experimental(all_objects, context_.clusters_, context_.pool_, label_buffers_); break;
+		case EClusteringAlgorithm::Batched: num_clusters_ = Cluster::CreateClusters_Batched(all_objects, context_.clusters_, context_.pool_); break;
+		default: num_clusters_ = Cluster::CreateClusters(all_objects, context_.clusters_, context_.pool_); break;
+		}
+		if (adaptive)
+		{
+			clustering_policy_.Report(std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - time_0).count());
+		}
+		return num_clusters_;
+	}
+
+	void CreateClustersDependencies()
+	{
+		MTO_TRACE_SCOPE("CreateClustersDependencies");
+		Cluster::CreateClustersDependencies(context_.clusters_, num_clusters_, dependency_sets_, cluster_priorities_, dependency_buffers_);
+	}
+
+	unsigned int GenerateClusterGroups()
+	{
+		MTO_TRACE_SCOPE("GenerateClusterGroups");
+		num_groups_ = GroupOfConcurrentClusters::GenerateClusterGroups(context_.clusters_, dependency_sets_, cluster_priorities_, group_buffers_, groups_);
+		return num_groups_;
+	}
+
+	/*
+	Runs the tiers priority after priority: the Critical tiers of all groups, then the High ones and so on. Without a frame budget
+	only the order changes. With it, deferrable clusters that would start after the deadline are left for the next frame.
+	With the group worker pool (default) all the tiers are published at once, otherwise every tier is a Parallel::ForEach.
+	*/
+	void Execute()
+	{
+		StartFrame();
+		ClusterTimer timer;
+		if (cluster_timing_)
+		{
+			cluster_times_.assign(num_clusters_, 0.0f);
+			timer = { context_.clusters_.data(), cluster_times_.data() };
+		}
+		bool use_group_worker_pool = use_group_worker_pool_;
+#if MTOBJECTS_COROUTINES
+		use_group_worker_pool = use_group_worker_pool && !(time_slice_us_ > 0.0f);
+#endif
+		if (use_group_worker_pool)
+		{
+			const unsigned int num_threads = Parallel::NumThreads();
+			UpdateDispatchThresholds(num_threads);
+			MTO_TRACE_SCOPE("Execute");
+			const auto time_0 = std::chrono::steady_clock::now();
+			group_work_list_.Reset(deadline_, inline_threshold_, batch_threshold_, num_threads, prefetch_distance_, timer);
+			for (unsigned int tier_idx = 0; tier_idx < kNumPriorities; tier_idx++)
+			{
+				for (unsigned int group_idx = 0; group_idx < num_groups_; group_idx++)
+				{
+					group_work_list_.Add(groups_[group_idx], static_cast<EPriority>(tier_idx));
+				}
+			}
+			GroupWorkerPool::Get().Run(group_work_list_);
+			ReportExecuteTime(std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - time_0).count(), num_threads, group_work_list_.GetNumObjects());
+			IF_TELEMETRY(Telemetry::Add(EStat::GroupsInlined, group_work_list_.GetNumInlinedTiers()));
+			IF_TELEMETRY(Telemetry::Add(EStat::ClusterBatches, group_work_list_.GetNumBatches()));
+		}
+		else
+		{
+			MTO_TRACE_SCOPE("Execute");
+			for (unsigned int tier_idx = 0; tier_idx < kNumPriorities; tier_idx++)
+			{
+				for (unsigned int group_idx = 0; group_idx < num_groups_; group_idx++)
+				{
+					if (0 == groups_[group_idx].GetTier(static_cast<EPriority>(tier_idx)).size())
+						continue;
+					MTO_TRACE_SCOPE_ARG("Group", "index", group_idx);
+#if MTOBJECTS_COROUTINES
+					if (time_slice_us_ > 0.0f)
+					{
+						groups_[group_idx].ExecuteTierCooperative(static_cast<EPriority>(tier_idx), deadline_, cooperative_buffers_);
+						continue;
+					}
+#endif
+					groups_[group_idx].ExecuteTier(static_cast<EPriority>(tier_idx), deadline_, prefetch_distance_, timer);
+				}
+			}
+		}
+		FinishFrame();
+	}
+
+	/*
+	Multi-phase Execute: every object runs PhaseTask(0) .. PhaseTask(num_phases - 1) over the clusters of the frame, see PhaseGraph.
+	A cluster moves to the next phase as soon as the clusters it conflicts with allow it, there is no barrier between the phases.
+	Time slices are not used.
+	*/
+	void ExecutePhases(unsigned int num_phases)
+	{
+		Assert(num_phases && num_phases <= PhaseGraph::kMaxPhases);
+		StartFrame();
+		{
+			MTO_TRACE_SCOPE_ARG("ExecutePhases", "phases", num_phases);
+			phase_graph_.Build(context_.clusters_, dependency_sets_, cluster_priorities_, groups_, num_groups_, num_phases);
+			phase_graph_.Execute(deadline_, prefetch_distance_);
+		}
+		FinishFrame();
+	}
+
+	/*
+	Looks up the schedule of an earlier frame with the same dependency graph. On a hit the clusters, their dependencies and
+	the groups are restored and the frame can be executed right away. On a miss the phases have to run and StoreSchedule() remembers the result.
+	After a frame that deferred objects it always misses, the promoted priorities have to be recomputed.
+	*/
+	bool RestoreCachedSchedule(const vector<IThreadSafeObject*>& all_objects)
+	{
+		MTO_TRACE_SCOPE("RestoreCachedSchedule");
+		StartFrame();
+		schedule_key_ = schedule_cache_.ComputeKey(all_objects, context_.pool_);
+		schedule_num_objects_ = all_objects.size();
+		const ScheduleCache::Entry* entry = last_frame_deferred_objects_ ? nullptr : schedule_cache_.Find(schedule_key_, schedule_num_objects_);
+		if (!entry)
+		{
+			IF_TELEMETRY(Telemetry::Add(EStat::ScheduleCacheMisses, 1));
+			return false;
+		}
+
+		num_clusters_ = entry->GetNumClusters();
+		Parallel::For<unsigned int>(0, num_clusters_, [this, entry](unsigned int cluster_idx)
+		{
+			auto& objects = context_.clusters_[cluster_idx].GetObjects();
+			for (uint32_t obj_idx = entry->cluster_offsets_[cluster_idx]; obj_idx < entry->cluster_offsets_[cluster_idx + 1]; obj_idx++)
+			{
+				IThreadSafeObject* obj = entry->objects_[obj_idx];
+				objects.push_back<true>(obj);
+				obj->SetClusterIndex(static_cast<TClusterIndex>(cluster_idx));
+			}
+		});
+		dependency_sets_.assign(entry->dependency_sets_.begin(), entry->dependency_sets_.end());
+		cluster_priorities_.assign(entry->cluster_priorities_.begin(), entry->cluster_priorities_.end());
+
+		num_groups_ = entry->GetNumGroups();
+		Cluster** grouped_clusters = group_buffers_.grouped_clusters_.data();
+		for (size_t idx = 0; idx < entry->group_clusters_.size(); idx++)
+		{
+			grouped_clusters[idx] = &context_.clusters_[entry->group_clusters_[idx]];
+		}
+		for (unsigned int group_idx = 0; group_idx < num_groups_; group_idx++)
+		{
+			groups_[group_idx].SetClusters({ grouped_clusters + entry->group_offsets_[group_idx], entry->group_offsets_[group_idx + 1] - entry->group_offsets_[group_idx] },
+				context_.clusters_, cluster_priorities_);
+		}
+		IF_TELEMETRY(Telemetry::Add(EStat::ScheduleCacheHits, 1));
+		return true;
+	}
+
+	/*
+	Call after GenerateClusterGroups of a frame that missed in RestoreCachedSchedule. Nothing is stored after a frame that
+	deferred objects: their clusters are promoted and the key doesn't tell, a later hit would never defer them again.
+	*/
+	void StoreSchedule()
+	{
+		if (last_frame_deferred_objects_)
+			return;
+		MTO_TRACE_SCOPE("StoreSchedule");
+		schedule_cache_.Store(schedule_key_, schedule_num_objects_, context_.clusters_, dependency_sets_, cluster_priorities_, groups_, num_groups_);
+	}
+
+	// num_phases > 1 - ExecutePhases instead of Execute
+	void ExecuteFrame(const vector<IThreadSafeObject*>& all_objects, unsigned int num_phases = 1)
+	{
+		if (!(use_schedule_cache_ && RestoreCachedSchedule(all_objects)))
+		{
+			CreateClusters(all_objects);
+			CreateClustersDependencies();
+			GenerateClusterGroups();
+			if (use_schedule_cache_)
+			{
+				StoreSchedule();
+			}
+		}
+		if (num_phases > 1)
+		{
+			ExecutePhases(num_phases);
+		}
+		else
+		{
+			Execute();
+		}
+	}
+
+	void SetClusteringAlgorithm(EClusteringAlgorithm algorithm) { clustering_algorithm_ = algorithm; }
+	EClusteringAlgorithm GetClusteringAlgorithm() const { return clustering_algorithm_; }
+	// Used with EClusteringAlgorithm::Adaptive, the decisions can be audited with ClusteringPolicy::WriteLog.
+	ClusteringPolicy& GetClusteringPolicy() { return clustering_policy_; }
+	const ClusteringPolicy& GetClusteringPolicy() const { return clustering_policy_; }
+
+	/*
+	Budget of a whole frame, from its first phase to the end of Execute, 0 - no deadline. Clusters with a priority at or below
+	min_deferrable may be deferred to the next frame when it runs out.
+	*/
+	void SetFrameBudget(float budget_us, EPriority min_deferrable = EPriority::Low) { frame_budget_us_ = budget_us; min_deferrable_ = min_deferrable; }
+	float GetFrameBudget() const { return frame_budget_us_; }
+	bool LastFrameMissedDeadline() const { return last_frame_missed_deadline_; }
+	unsigned int GetLastFrameDeferredClusters() const { return last_frame_deferred_clusters_; }
+	unsigned int GetLastFrameDeferredObjects() const { return last_frame_deferred_objects_; }
+	const vector<EPriority>& GetClusterPriorities() const { return cluster_priorities_; }
+
+#if MTOBJECTS_COROUTINES
+	/*
+	Time slice of a cluster in Execute, 0 - clusters run to completion (default). With a slice, clusters that contain
+	cooperative objects (IThreadSafeObject::cooperative_) are suspended at their yield points and interleaved with the other clusters of the tier.
+	*/
+	void SetTimeSlice(float time_slice_us)
+	{
+		time_slice_us_ = time_slice_us;
+		cooperative_buffers_.time_slice_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float, std::micro>(time_slice_us));
+	}
+	float GetTimeSlice() const { return time_slice_us_; }
+#endif
+
+	// On by default. Execute runs on the GroupWorkerPool, not used with a time slice.
+	void EnableGroupWorkerPool(bool enable) { use_group_worker_pool_ = enable; }
+	bool IsGroupWorkerPoolEnabled() const { return use_group_worker_pool_; }
+	// On by default. With the group worker pool tiny tiers run inline and tiny clusters in batches, see UpdateDispatchThresholds.
+	void EnableAdaptiveDispatch(bool enable) { adaptive_dispatch_ = enable; }
+	bool IsAdaptiveDispatchEnabled() const { return adaptive_dispatch_; }
+
+	/*
+	Measures the dispatch cost of the group worker pool with Parallel::NumThreads() threads, takes about a millisecond.
+	Call it between frames, before the first one and after a change of the thread count, the frames never measure it themselves.
+	*/
+	void Calibrate()
+	{
+		MTO_TRACE_SCOPE("MeasureDispatchCost");
+		dispatch_cost_ = GroupWorkerPool::Get().MeasureDispatchCost();
+	}
+	bool IsCalibrated() const { return dispatch_cost_.num_threads_ == Parallel::NumThreads(); }
+	const DispatchCost& GetDispatchCost() const { return dispatch_cost_; }
+	unsigned int GetInlineThreshold() const { return inline_threshold_; }
+	unsigned int GetBatchThreshold() const { return batch_threshold_; }
+	// Objects the execution prefetches ahead within a cluster, 0 - off (default), see Cluster::ForEachObject. Not used with a time slice.
+	// Worth trying when the objects of a cluster are scattered in memory and their tasks are short.
+	void SetPrefetchDistance(unsigned int prefetch_distance) { prefetch_distance_ = prefetch_distance; }
+	unsigned int GetPrefetchDistance() const { return prefetch_distance_; }
+
+	/*
+	Off by default. When on, Execute records the time every cluster took on its worker, see GetClusterTimes. Clusters run
+	with a time slice or by ExecutePhases aren't timed.
+	*/
+	void EnableClusterTiming(bool enable)
+	{
+		cluster_timing_ = enable;
+		if (enable)
+		{
+			cluster_times_.reserve(kMaxClusters); // no allocations in the frames
+		}
+	}
+	// [ns] per cluster of the last Execute, indexed like GetClusters(). 0 for a deferred cluster.
+	const vector<float>& GetClusterTimes() const { return cluster_times_; }
+
+	// Off by default, see ScheduleCache for the requirements on the objects.
+	void EnableScheduleCache(bool enable) { use_schedule_cache_ = enable; schedule_cache_.Clear(); }
+	bool IsScheduleCacheEnabled() const { return use_schedule_cache_; }
+	const ScheduleCache& GetScheduleCache() const { return schedule_cache_; }
+
+	SchedulerContext& GetContext() { return context_; }
+	const ClusterArray& GetClusters() const { return context_.clusters_; }
+	unsigned int GetNumClusters() const { return num_clusters_; }
+	unsigned int GetNumGroups() const { return num_groups_; }
+	const GroupOfConcurrentClusters& GetGroup(unsigned int group_idx) const { Assert(group_idx < num_groups_); return groups_[group_idx]; }
+	const vector<IndexSet>& GetDependencySets() const { return dependency_sets_; }
+	// Counters of the last executed frame, see Telemetry.
+	const FrameStats& GetLastFrameStats() const { return last_frame_stats_; }
+};
+}
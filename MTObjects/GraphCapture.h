@@ -0,0 +1,395 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif //_WIN32
+
+namespace MTObjects
+{
+	/*
+	Binary capture of one frame's dependency graph. All the values are little endian uint32, so a file can be
+	used in place once mapped:
+		GraphFileHeader
+		cost[num_objects]
+		dependency_offsets[num_objects + 1], dependencies[num_dependencies]					- IsDependentOn edges (object indices)
+		const_dependency_offsets[num_objects + 1], const_dependencies[num_const_dependencies]	- GetConstDependencies edges
+	Objects are stored in the order they were passed to the scheduler.
+	*/
+	struct GraphFileHeader
+	{
+		static const constexpr uint32_t kMagic = 0x474F544D; // "MTOG"
+		static const constexpr uint32_t kVersion = 1;
+
+		uint32_t magic_ = kMagic;
+		uint32_t version_ = kVersion;
+		uint32_t num_objects_ = 0;
+		uint32_t num_dependencies_ = 0;
+		uint32_t num_const_dependencies_ = 0;
+		uint32_t reserved_ = 0;
+	};
+	static_assert(sizeof(GraphFileHeader) == 6 * sizeof(uint32_t));
+
+	namespace GraphCaptureStuff
+	{
+		inline void WriteArray(std::ostream& out, const vector<uint32_t>& values)
+		{
+			out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(uint32_t));
+		}
+
+		// The offsets start at 0, never go back and end at num_edges, every edge is an object index.
+		inline bool IsValidEdgeList(const uint32_t* offsets, const uint32_t* edges, uint32_t num_objects, uint32_t num_edges)
+		{
+			if (0 != offsets[0] || num_edges != offsets[num_objects])
+				return false;
+			for (uint32_t obj_idx = 0; obj_idx < num_objects; obj_idx++)
+			{
+				if (offsets[obj_idx] > offsets[obj_idx + 1])
+					return false;
+			}
+			for (uint32_t edge = 0; edge < num_edges; edge++)
+			{
+				if (edges[edge] >= num_objects)
+					return false;
+			}
+			return true;
+		}
+
+		/*
+		The most clusters Cluster::CreateClusters holds at once for the objects in this order: an object not reached yet starts a
+		cluster, the objects it depends on (transitively) join it and the clusters it reaches are merged into it. Never fewer
+		than the weakly connected components, the clusters of the frame.
+		*/
+		inline uint32_t CountPeakClusters(const uint32_t* offsets, const uint32_t* edges, uint32_t num_objects)
+		{
+			vector<uint32_t> parents(num_objects);
+			vector<bool> reached(num_objects, false);
+			vector<uint32_t> to_handle;
+			for (uint32_t obj_idx = 0; obj_idx < num_objects; obj_idx++)
+			{
+				parents[obj_idx] = obj_idx;
+			}
+			auto find = [&parents](uint32_t obj_idx)
+			{
+				while (parents[obj_idx] != obj_idx)
+				{
+					parents[obj_idx] = parents[parents[obj_idx]];
+					obj_idx = parents[obj_idx];
+				}
+				return obj_idx;
+			};
+			uint32_t num_clusters = 0;
+			uint32_t peak = 0;
+			for (uint32_t initial_idx = 0; initial_idx < num_objects; initial_idx++)
+			{
+				if (reached[initial_idx])
+					continue;
+				peak = std::max(peak, ++num_clusters);
+				reached[initial_idx] = true;
+				to_handle.push_back(initial_idx);
+				while (!to_handle.empty())
+				{
+					const uint32_t obj_idx = to_handle.back();
+					to_handle.pop_back();
+					for (uint32_t edge = offsets[obj_idx]; edge < offsets[obj_idx + 1]; edge++)
+					{
+						const uint32_t dependency = edges[edge];
+						const uint32_t root = find(obj_idx);
+						const uint32_t dependency_root = find(dependency);
+						if (root == dependency_root)
+							continue;
+						parents[dependency_root] = root;
+						if (reached[dependency])
+						{
+							num_clusters--; // merged
+							continue;
+						}
+						reached[dependency] = true;
+						to_handle.push_back(dependency);
+					}
+				}
+			}
+			return peak;
+		}
+
+		// Read-only mapping of a whole file. IsValid() is false if the file can't be opened.
+		class MappedFile
+		{
+			const void* data_ = nullptr;
+			size_t size_ = 0;
+#ifdef _WIN32
+			HANDLE file_ = INVALID_HANDLE_VALUE;
+			HANDLE mapping_ = nullptr;
+#endif //_WIN32
+
+		public:
+			explicit MappedFile(const char* file_name)
+			{
+#ifdef _WIN32
+				file_ = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+				LARGE_INTEGER size;
+				if (INVALID_HANDLE_VALUE == file_ || !GetFileSizeEx(file_, &size) || 0 == size.QuadPart)
+					return;
+				mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (!mapping_)
+					return;
+				data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+				size_ = data_ ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+				const int fd = open(file_name, O_RDONLY);
+				if (fd < 0)
+					return;
+				struct stat file_stat;
+				if (0 == fstat(fd, &file_stat) && file_stat.st_size > 0)
+				{
+					void* ptr = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+					if (MAP_FAILED != ptr)
+					{
+						data_ = ptr;
+						size_ = static_cast<size_t>(file_stat.st_size);
+					}
+				}
+				close(fd); // the mapping keeps the file alive
+#endif //_WIN32
+			}
+
+			~MappedFile()
+			{
+#ifdef _WIN32
+				if (data_)
+				{
+					UnmapViewOfFile(data_);
+				}
+				if (mapping_)
+				{
+					CloseHandle(mapping_);
+				}
+				if (INVALID_HANDLE_VALUE != file_)
+				{
+					CloseHandle(file_);
+				}
+#else
+				if (data_)
+				{
+					munmap(const_cast<void*>(data_), size_);
+				}
+#endif //_WIN32
+			}
+
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+
+			bool IsValid() const { return nullptr != data_; }
+			const void* GetData() const { return data_; }
+			size_t GetSize() const { return size_; }
+		};
+	}
+
+	/*
+	Writes the graph of all_objects. Const edges and costs come from the optional IThreadSafeObject::GetConstDependencies
+	and GetCost. Dependencies on objects that are not in all_objects are dropped.
+	The pool is used only for the temporary IsDependentOn containers, call it between frames.
+	*/
+	inline bool CaptureGraph(const vector<IThreadSafeObject*>& all_objects, ChunkMemoryPool& pool, std::ostream& out)
+	{
+		using GraphCaptureStuff::WriteArray;
+		std::unordered_map<const IThreadSafeObject*, uint32_t> object_indexes;
+		object_indexes.reserve(all_objects.size());
+		for (size_t obj_idx = 0; obj_idx < all_objects.size(); obj_idx++)
+		{
+			object_indexes.emplace(all_objects[obj_idx], static_cast<uint32_t>(obj_idx));
+		}
+
+		vector<uint32_t> costs;
+		vector<uint32_t> dependency_offsets;
+		vector<uint32_t> dependencies;
+		vector<uint32_t> const_dependency_offsets;
+		vector<uint32_t> const_dependencies;
+		costs.reserve(all_objects.size());
+		dependency_offsets.reserve(all_objects.size() + 1);
+		const_dependency_offsets.reserve(all_objects.size() + 1);
+
+		FastContainer<IThreadSafeObject*> object_dependencies(pool);
+		vector<const IThreadSafeObject*> object_const_dependencies;
+		auto add_dependency = [&object_indexes](vector<uint32_t>& out_indexes, const IThreadSafeObject* dependency)
+		{
+			auto iter = object_indexes.find(dependency);
+			if (iter != object_indexes.end())
+			{
+				out_indexes.push_back(iter->second);
+			}
+		};
+		for (auto obj : all_objects)
+		{
+			costs.push_back(obj->GetCost());
+
+			dependency_offsets.push_back(static_cast<uint32_t>(dependencies.size()));
+			obj->IsDependentOn(object_dependencies);
+			for (auto dependency : object_dependencies)
+			{
+				add_dependency(dependencies, dependency);
+			}
+			object_dependencies.clear<false>();
+
+			const_dependency_offsets.push_back(static_cast<uint32_t>(const_dependencies.size()));
+			obj->GetConstDependencies(object_const_dependencies);
+			for (auto dependency : object_const_dependencies)
+			{
+				add_dependency(const_dependencies, dependency);
+			}
+			object_const_dependencies.clear();
+		}
+		dependency_offsets.push_back(static_cast<uint32_t>(dependencies.size()));
+		const_dependency_offsets.push_back(static_cast<uint32_t>(const_dependencies.size()));
+
+		GraphFileHeader header;
+		header.num_objects_ = static_cast<uint32_t>(all_objects.size());
+		header.num_dependencies_ = static_cast<uint32_t>(dependencies.size());
+		header.num_const_dependencies_ = static_cast<uint32_t>(const_dependencies.size());
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		WriteArray(out, costs);
+		WriteArray(out, dependency_offsets);
+		WriteArray(out, dependencies);
+		WriteArray(out, const_dependency_offsets);
+		WriteArray(out, const_dependencies);
+		return out.good();
+	}
+
+	class GraphReplay;
+
+	// Stands for one captured object. Its edges are read straight from the mapped file.
+	class ReplayObject : public IThreadSafeObject
+	{
+		friend class GraphReplay;
+		const GraphReplay* graph_ = nullptr;
+		uint32_t index_ = 0;
+
+	public:
+		void IsDependentOn(FastContainer<IThreadSafeObject*>& ref_dependencies) const override;
+		void IsConstDependentOn(IndexSet& ref_dependencies) const override;
+		void GetConstDependencies(vector<const IThreadSafeObject*>& out_dependencies) const override;
+		unsigned int GetCost() const override;
+
+		// Burns the captured cost, one loop iteration per unit.
+		void Task() override
+		{
+			volatile uint32_t sink = 0;
+			for (uint32_t unit = GetCost(); unit > 0; unit--)
+			{
+				sink = sink + unit;
+			}
+		}
+	};
+
+	/*
+	Maps a capture file and creates one ReplayObject per captured object. Nothing is parsed nor copied, loading costs
+	the mapping, one validation pass over the offsets and edges and the object array. A file that fails the validation
+	(e.g. corrupted or hand-made) is not valid, the edges of a valid one are never out of bounds.
+	*/
+	class GraphReplay
+	{
+		friend class ReplayObject;
+		GraphCaptureStuff::MappedFile file_;
+		const uint32_t* costs_ = nullptr;
+		const uint32_t* dependency_offsets_ = nullptr;
+		const uint32_t* dependencies_ = nullptr;
+		const uint32_t* const_dependency_offsets_ = nullptr;
+		const uint32_t* const_dependencies_ = nullptr;
+		uint32_t num_objects_ = 0;
+		std::unique_ptr<ReplayObject[]> objects_;
+
+	public:
+		explicit GraphReplay(const char* file_name)
+			: file_(file_name)
+		{
+			if (!file_.IsValid() || file_.GetSize() < sizeof(GraphFileHeader))
+				return;
+			const GraphFileHeader& header = *static_cast<const GraphFileHeader*>(file_.GetData());
+			const uint64_t expected_size = sizeof(GraphFileHeader) + sizeof(uint32_t) *
+				(3ull * header.num_objects_ + 2 + header.num_dependencies_ + header.num_const_dependencies_);
+			if (GraphFileHeader::kMagic != header.magic_ || GraphFileHeader::kVersion != header.version_ || expected_size != file_.GetSize())
+				return;
+
+			costs_ = reinterpret_cast<const uint32_t*>(&header + 1);
+			dependency_offsets_ = costs_ + header.num_objects_;
+			dependencies_ = dependency_offsets_ + header.num_objects_ + 1;
+			const_dependency_offsets_ = dependencies_ + header.num_dependencies_;
+			const_dependencies_ = const_dependency_offsets_ + header.num_objects_ + 1;
+			if (!GraphCaptureStuff::IsValidEdgeList(dependency_offsets_, dependencies_, header.num_objects_, header.num_dependencies_)
+				|| !GraphCaptureStuff::IsValidEdgeList(const_dependency_offsets_, const_dependencies_, header.num_objects_, header.num_const_dependencies_))
+				return;
+			num_objects_ = header.num_objects_;
+
+			objects_.reset(new ReplayObject[num_objects_]);
+			for (uint32_t obj_idx = 0; obj_idx < num_objects_; obj_idx++)
+			{
+				objects_[obj_idx].graph_ = this;
+				objects_[obj_idx].index_ = obj_idx;
+			}
+		}
+
+		GraphReplay(const GraphReplay&) = delete;
+		GraphReplay& operator=(const GraphReplay&) = delete;
+
+		bool IsValid() const { return nullptr != objects_; }
+		uint32_t GetNumObjects() const { return num_objects_; }
+		uint32_t GetNumDependencies() const { return num_objects_ ? dependency_offsets_[num_objects_] : 0; }
+		uint32_t GetNumConstDependencies() const { return num_objects_ ? const_dependency_offsets_[num_objects_] : 0; }
+		// The most clusters a frame of GetObjects() holds at once, has to fit into kMaxClusters. A pass over the dependencies.
+		uint32_t CountPeakClusters() const { return GraphCaptureStuff::CountPeakClusters(dependency_offsets_, dependencies_, num_objects_); }
+
+		// In the captured order
+		vector<IThreadSafeObject*> GetObjects() const
+		{
+			vector<IThreadSafeObject*> all_objects(num_objects_);
+			for (uint32_t obj_idx = 0; obj_idx < num_objects_; obj_idx++)
+			{
+				all_objects[obj_idx] = &objects_[obj_idx];
+			}
+			return all_objects;
+		}
+	};
+
+	inline void ReplayObject::IsDependentOn(FastContainer<IThreadSafeObject*>& ref_dependencies) const
+	{
+		for (uint32_t edge = graph_->dependency_offsets_[index_]; edge < graph_->dependency_offsets_[index_ + 1]; edge++)
+		{
+			ref_dependencies.push_back<false>(&graph_->objects_[graph_->dependencies_[edge]]);
+		}
+	}
+
+	inline void ReplayObject::IsConstDependentOn(IndexSet& ref_dependencies) const
+	{
+		for (uint32_t edge = graph_->const_dependency_offsets_[index_]; edge < graph_->const_dependency_offsets_[index_ + 1]; edge++)
+		{
+			ref_dependencies[graph_->objects_[graph_->const_dependencies_[edge]].GetClusterIndex()] = true;
+		}
+	}
+
+	inline void ReplayObject::GetConstDependencies(vector<const IThreadSafeObject*>& out_dependencies) const
+	{
+		for (uint32_t edge = graph_->const_dependency_offsets_[index_]; edge < graph_->const_dependency_offsets_[index_ + 1]; edge++)
+		{
+			out_dependencies.push_back(&graph_->objects_[graph_->const_dependencies_[edge]]);
+		}
+	}
+
+	inline unsigned int ReplayObject::GetCost() const
+	{
+		return graph_->costs_[index_];
+	}
+}
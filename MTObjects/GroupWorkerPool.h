@@ -0,0 +1,347 @@
+#pragma once
+
+#include "Utils.h"
+#include <atomic>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <cstdint>
+#include <chrono>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#else
+#include <condition_variable>
+#endif
+
+namespace MTObjects
+{
+	namespace GroupWorkerPoolStuff
+	{
+		/*
+		A 32 bit word threads can wait on. A waiter spins first and then parks in the kernel (futex on Linux, WaitOnAddress on
+		Windows, a condition variable elsewhere). Store wakes the parked waiters, it makes the system call only when there are any.
+		*/
+		class alignas(64) ParkingWord
+		{
+			std::atomic<uint32_t> value_ = { 0 };
+			std::atomic<uint32_t> num_parked_ = { 0 };
+#if !defined(__linux__) && !defined(_WIN32)
+			std::mutex mutex_;
+			std::condition_variable condition_;
+#endif
+			static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the kernel waits on the plain word");
+
+			void Park(uint32_t expected)
+			{
+#ifdef __linux__
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value_), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+				WaitOnAddress(reinterpret_cast<volatile VOID*>(&value_), &expected, sizeof(expected), INFINITE);
+#else
+				std::unique_lock<std::mutex> lock(mutex_);
+				condition_.wait(lock, [&]() { return value_.load() != expected; });
+#endif
+			}
+
+			void WakeAll()
+			{
+#ifdef __linux__
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value_), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+				WakeByAddressAll(reinterpret_cast<PVOID>(&value_));
+#else
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+				}
+				condition_.notify_all();
+#endif
+			}
+
+		public:
+			uint32_t Load() const { return value_.load(std::memory_order_acquire); }
+
+			// Returns when the value differs from expected. Spurious wake-ups are handled here.
+			void Wait(uint32_t expected, unsigned int spin_count)
+			{
+				for (unsigned int spin = 0; spin < spin_count; spin++)
+				{
+					if (Load() != expected)
+						return;
+					CpuRelax();
+				}
+				// seq_cst pairs with Store: either the waker sees num_parked_ or the waiter sees the new value
+				num_parked_.fetch_add(1);
+				while (value_.load() == expected)
+				{
+					Park(expected);
+				}
+				num_parked_.fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			void Store(uint32_t value)
+			{
+				value_.store(value);
+				if (num_parked_.load())
+				{
+					WakeAll();
+				}
+			}
+
+			// Store(Load() + 1) for concurrent wakers, none of the changes is lost.
+			void Increment()
+			{
+				value_.fetch_add(1);
+				if (num_parked_.load())
+				{
+					WakeAll();
+				}
+			}
+		};
+
+		/*
+		Reusable barrier of a fixed number of threads. The last thread to arrive runs on_complete before it releases the others,
+		so it can reset the shared state of the next phase.
+		*/
+		class SpinBarrier
+		{
+			alignas(64) std::atomic<unsigned int> num_arrived_ = { 0 };
+			ParkingWord generation_;
+			unsigned int num_threads_ = 1;
+
+		public:
+			// Only while no thread waits.
+			void SetNumThreads(unsigned int num_threads) { num_threads_ = std::max(1u, num_threads); }
+
+			template<typename TFunction> void Wait(unsigned int spin_count, const TFunction& on_complete)
+			{
+				const uint32_t generation = generation_.Load();
+				if (num_arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == num_threads_)
+				{
+					num_arrived_.store(0, std::memory_order_relaxed);
+					on_complete();
+					generation_.Store(generation + 1);
+					return;
+				}
+				generation_.Wait(generation, spin_count);
+			}
+		};
+	}
+
+	// Work of GroupWorkerPool::Run: phases run one after another, the indices of a phase run concurrently.
+	struct IPhasedJob
+	{
+		virtual unsigned int GetNumPhases() const = 0;
+		virtual unsigned int GetPhaseSize(unsigned int phase) const = 0;
+		virtual void Run(unsigned int phase, unsigned int idx) = 0;
+	};
+
+	// Overhead of GroupWorkerPool::Run with the thread count it was measured with, see GroupWorkerPool::MeasureDispatchCost.
+	struct DispatchCost
+	{
+		unsigned int num_threads_ = 0; // 0 - not measured
+		float phase_ns_ = 0.0f; // the handoff from a phase to the next one, barrier and wake-ups
+		float index_ns_ = 0.0f; // the claim of an index, per thread
+	};
+
+	/*
+	Dedicated persistent workers for the execution of cluster groups. A whole frame of groups is published at once as an
+	IPhasedJob, the workers are woken once and go from group to group through a barrier, without a fork/join per group.
+	Idle workers spin for spin_count iterations before they park, so a phase published soon after the previous one finds them awake.
+	The size follows Parallel::NumThreads() and is checked on every Run. With more threads than hardware threads spinning
+	would only steal time from the working threads, the workers then park right away.
+	Nested calls, calls while another thread runs a job or a single thread run the job inline.
+	*/
+	class GroupWorkerPool
+	{
+	public:
+		static const constexpr unsigned int kDefaultSpinCount = 2048;
+
+	private:
+		vector<std::thread> workers_;
+		std::mutex dispatch_mutex_;
+		GroupWorkerPoolStuff::ParkingWord job_generation_;
+		GroupWorkerPoolStuff::SpinBarrier barrier_;
+		alignas(64) std::atomic<unsigned int> next_idx_ = { 0 };
+		IPhasedJob* job_ = nullptr;
+		unsigned int spin_count_ = kDefaultSpinCount;
+		unsigned int worker_spin_count_ = kDefaultSpinCount;
+		std::atomic<bool> stop_ = { false };
+
+		static bool& IsInsideJob() { thread_local bool value = false; return value; }
+
+		void Work()
+		{
+			IPhasedJob& job = *job_;
+			const unsigned int num_phases = job.GetNumPhases();
+			for (unsigned int phase = 0; phase < num_phases; phase++)
+			{
+				const unsigned int phase_size = job.GetPhaseSize(phase);
+				for (unsigned int idx = next_idx_.fetch_add(1, std::memory_order_relaxed); idx < phase_size; idx = next_idx_.fetch_add(1, std::memory_order_relaxed))
+				{
+					job.Run(phase, idx);
+				}
+				barrier_.Wait(worker_spin_count_, [this]() { next_idx_.store(0, std::memory_order_relaxed); });
+			}
+		}
+
+		void WorkerLoop(uint32_t seen_generation)
+		{
+			IsInsideJob() = true;
+			for (;;)
+			{
+				job_generation_.Wait(seen_generation, worker_spin_count_);
+				if (stop_.load(std::memory_order_acquire))
+					return;
+				seen_generation = job_generation_.Load();
+				Work();
+			}
+		}
+
+		void StartWorkers(unsigned int num_threads)
+		{
+			num_threads = std::max(1u, num_threads);
+			stop_.store(false, std::memory_order_relaxed);
+			worker_spin_count_ = (num_threads <= std::max(1u, std::thread::hardware_concurrency())) ? spin_count_ : 0;
+			barrier_.SetNumThreads(num_threads);
+			for (unsigned int i = 0; i + 1 < num_threads; i++) // the caller is a worker too
+			{
+				workers_.emplace_back([this, generation = job_generation_.Load()]() { WorkerLoop(generation); });
+			}
+		}
+
+		void StopWorkers()
+		{
+			stop_.store(true, std::memory_order_release);
+			job_generation_.Store(job_generation_.Load() + 1);
+			for (auto& worker : workers_)
+			{
+				worker.join();
+			}
+			workers_.clear();
+		}
+
+		GroupWorkerPool() = default;
+
+	public:
+		~GroupWorkerPool()
+		{
+			StopWorkers();
+		}
+		GroupWorkerPool(const GroupWorkerPool&) = delete;
+		GroupWorkerPool& operator=(const GroupWorkerPool&) = delete;
+
+		static GroupWorkerPool& Get() { static GroupWorkerPool instance; return instance; }
+
+		unsigned int NumThreads() const { return static_cast<unsigned int>(workers_.size()) + 1; }
+
+		// Don't call it while a job runs. Needed before fork: the child would wait for workers it doesn't have.
+		void SetNumThreads(unsigned int num_threads)
+		{
+			std::lock_guard<std::mutex> dispatch_lock(dispatch_mutex_);
+			StopWorkers();
+			StartWorkers(num_threads);
+		}
+
+		// Iterations an idle thread spins before it parks, 0 - park right away. Restarts the workers.
+		void SetSpinCount(unsigned int spin_count)
+		{
+			spin_count_ = spin_count;
+			SetNumThreads(NumThreads());
+		}
+		unsigned int GetSpinCount() const { return spin_count_; }
+
+		void Run(IPhasedJob& job)
+		{
+			const unsigned int num_phases = job.GetNumPhases();
+			if (0 == num_phases)
+				return;
+			// Nothing to share, don't wake the workers
+			if (1 == num_phases && 1 == job.GetPhaseSize(0))
+			{
+				job.Run(0, 0);
+				return;
+			}
+			std::unique_lock<std::mutex> dispatch_lock(dispatch_mutex_, std::try_to_lock);
+			if (!IsInsideJob() && dispatch_lock.owns_lock() && NumThreads() != Parallel::NumThreads())
+			{
+				StopWorkers();
+				StartWorkers(Parallel::NumThreads());
+			}
+			if (IsInsideJob() || !dispatch_lock.owns_lock() || workers_.empty())
+			{
+				for (unsigned int phase = 0; phase < num_phases; phase++)
+				{
+					const unsigned int phase_size = job.GetPhaseSize(phase);
+					for (unsigned int idx = 0; idx < phase_size; idx++)
+					{
+						job.Run(phase, idx);
+					}
+				}
+				return;
+			}
+
+			job_ = &job;
+			job_generation_.Store(job_generation_.Load() + 1);
+			IsInsideJob() = true;
+			Work();
+			IsInsideJob() = false;
+			job_ = nullptr;
+		}
+
+		/*
+		Runs jobs without work with Parallel::NumThreads() threads, takes about a millisecond. The medians of kNumSamples runs:
+		kNumPhases phases of an index per thread for phase_ns_, a phase of kNumIndices indices per thread for index_ns_.
+		*/
+		DispatchCost MeasureDispatchCost()
+		{
+			static const constexpr unsigned int kNumSamples = 16;
+			static const constexpr unsigned int kNumPhases = 16;
+			static const constexpr unsigned int kNumIndices = 256;
+
+			struct EmptyJob : public IPhasedJob
+			{
+				unsigned int num_phases_ = 0;
+				unsigned int phase_size_ = 0;
+				std::atomic<unsigned int> num_runs_ = { 0 };
+
+				unsigned int GetNumPhases() const override { return num_phases_; }
+				unsigned int GetPhaseSize(unsigned int) const override { return phase_size_; }
+				void Run(unsigned int, unsigned int) override { num_runs_.fetch_add(1, std::memory_order_relaxed); }
+			};
+
+			auto median_ns = [this](EmptyJob& job)
+			{
+				std::array<float, kNumSamples> samples;
+				Run(job); // warm-up, starts the workers
+				for (float& sample : samples)
+				{
+					const auto time_0 = std::chrono::steady_clock::now();
+					Run(job);
+					sample = std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - time_0).count();
+				}
+				std::nth_element(samples.begin(), samples.begin() + kNumSamples / 2, samples.end());
+				return samples[kNumSamples / 2];
+			};
+
+			DispatchCost cost;
+			cost.num_threads_ = Parallel::NumThreads();
+			EmptyJob phases_job;
+			phases_job.num_phases_ = kNumPhases;
+			phases_job.phase_size_ = cost.num_threads_;
+			cost.phase_ns_ = median_ns(phases_job) / kNumPhases;
+			EmptyJob indices_job;
+			indices_job.num_phases_ = 1;
+			indices_job.phase_size_ = kNumIndices * cost.num_threads_;
+			cost.index_ns_ = median_ns(indices_job) / kNumIndices;
+			return cost;
+		}
+	};
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace MTObjects
+{
+/*
+The objects of a world, with spawns and destroys deferred to the end of the frame. While a frame runs, all_objects and the
+clusters are fixed, so a Task must not change the set itself: Spawn and Destroy only append to a buffer of the calling
+thread, without a lock once the thread has its buffer. ApplyPendingChanges, between two frames, appends the spawned objects
+in bulk and removes the destroyed ones by swap-remove - O(1) per object, the order of GetObjects changes. The clustering
+of the next frame is built from GetObjects anyway, nothing else has to be rebuilt.
+The registry doesn't own the objects, the callback of ApplyPendingChanges may free the destroyed ones. IThreadSafeObject has
+no virtual destructor, so the callback has to delete through the final type of the object. The remaining objects must not
+depend on a destroyed one.
+*/
+class ObjectRegistry
+{
+	struct alignas(64) ThreadBuffer
+	{
+		std::thread::id thread_id_;
+		vector<IThreadSafeObject*> spawned_;
+		vector<IThreadSafeObject*> destroyed_;
+	};
+
+	vector<IThreadSafeObject*> objects_;
+	vector<std::unique_ptr<ThreadBuffer>> buffers_;
+	std::mutex buffers_mutex_;
+	const uint64_t id_ = NextId(); // the address of a destroyed registry may be reused, the id not
+
+	static uint64_t NextId()
+	{
+		static std::atomic<uint64_t> next_id = { 1 };
+		return next_id.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// A thread remembers the buffer of the last registry it used, alternating between registries takes the lock every time.
+	ThreadBuffer& GetThreadBuffer()
+	{
+		struct CachedBuffer
+		{
+			uint64_t registry_id_ = 0;
+			ThreadBuffer* buffer_ = nullptr;
+		};
+		thread_local CachedBuffer cached;
+		if (cached.registry_id_ != id_)
+		{
+			const std::thread::id thread_id = std::this_thread::get_id();
+			std::lock_guard<std::mutex> lock(buffers_mutex_);
+			auto iter = std::find_if(buffers_.begin(), buffers_.end(), [&](const std::unique_ptr<ThreadBuffer>& buffer) { return buffer->thread_id_ == thread_id; });
+			if (buffers_.end() == iter)
+			{
+				buffers_.emplace_back(new ThreadBuffer());
+				buffers_.back()->thread_id_ = thread_id;
+				iter = buffers_.end() - 1;
+			}
+			cached.registry_id_ = id_;
+			cached.buffer_ = iter->get();
+		}
+		return *cached.buffer_;
+	}
+
+public:
+	ObjectRegistry() = default;
+	ObjectRegistry(const ObjectRegistry&) = delete;
+	ObjectRegistry& operator=(const ObjectRegistry&) = delete;
+	~ObjectRegistry()
+	{
+		for (IThreadSafeObject* obj : objects_)
+		{
+			obj->registry_slot_ = kNullRegistrySlot;
+		}
+	}
+
+	const vector<IThreadSafeObject*>& GetObjects() const { return objects_; }
+	unsigned int GetNumObjects() const { return static_cast<unsigned int>(objects_.size()); }
+	void Reserve(unsigned int num_objects) { objects_.reserve(num_objects); }
+
+	// Immediately, only between frames.
+	void Add(IThreadSafeObject* obj)
+	{
+		Assert(obj && kNullRegistrySlot == obj->registry_slot_);
+		obj->registry_slot_ = static_cast<unsigned int>(objects_.size());
+		obj->SetClusterIndex(kNullIndex);
+		obj->deferred_ = false;
+		objects_.push_back(obj);
+	}
+
+	// Immediately, only between frames. The last object takes the slot.
+	void Remove(IThreadSafeObject* obj)
+	{
+		const unsigned int slot = obj->registry_slot_;
+		Assert(slot < objects_.size() && objects_[slot] == obj);
+		IThreadSafeObject* const last = objects_.back();
+		objects_[slot] = last;
+		last->registry_slot_ = slot;
+		objects_.pop_back();
+		obj->registry_slot_ = kNullRegistrySlot;
+	}
+
+	// From a Task (any thread) or between frames. The object joins the next frame.
+	void Spawn(IThreadSafeObject* obj)
+	{
+		GetThreadBuffer().spawned_.push_back(obj);
+	}
+
+	// From a Task (any thread) or between frames. The object still runs in the current frame, the callback of ApplyPendingChanges gets it once.
+	// Unregistered objects are ignored.
+	void Destroy(IThreadSafeObject* obj)
+	{
+		GetThreadBuffer().destroyed_.push_back(obj);
+	}
+
+	/*
+	Between frames: adds the spawned objects and removes the destroyed ones, then calls on_destroyed(IThreadSafeObject*) for
+	every removed object. Spawns go first, an object spawned and destroyed in the same frame never shows up.
+	*/
+	template<typename TFunction> void ApplyPendingChanges(const TFunction& on_destroyed)
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex_);
+		unsigned int num_spawned = 0;
+		for (auto& buffer : buffers_)
+		{
+			num_spawned += static_cast<unsigned int>(buffer->spawned_.size());
+		}
+		objects_.reserve(objects_.size() + num_spawned);
+		for (auto& buffer : buffers_)
+		{
+			for (IThreadSafeObject* obj : buffer->spawned_)
+			{
+				Add(obj);
+			}
+			buffer->spawned_.clear();
+		}
+		IF_TELEMETRY(Telemetry::Add(EStat::ObjectsSpawned, num_spawned));
+
+		// All the objects are removed before the first callback, a duplicate must not be read once it may be freed.
+		unsigned int num_destroyed = 0;
+		for (auto& buffer : buffers_)
+		{
+			auto& destroyed = buffer->destroyed_;
+			destroyed.erase(std::remove_if(destroyed.begin(), destroyed.end(), [this](IThreadSafeObject* obj)
+			{
+				if (kNullRegistrySlot == obj->registry_slot_)
+					return true; // destroyed twice, or not registered
+				Remove(obj);
+				return false;
+			}), destroyed.end());
+			num_destroyed += static_cast<unsigned int>(destroyed.size());
+		}
+		for (auto& buffer : buffers_)
+		{
+			for (IThreadSafeObject* obj : buffer->destroyed_)
+			{
+				on_destroyed(obj);
+			}
+			buffer->destroyed_.clear();
+		}
+		IF_TELEMETRY(Telemetry::Add(EStat::ObjectsDestroyed, num_destroyed));
+	}
+
+	void ApplyPendingChanges()
+	{
+		ApplyPendingChanges([](IThreadSafeObject*) {});
+	}
+};
+}
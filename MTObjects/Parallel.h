@@ -0,0 +1,294 @@
+#pragma once
+
+/*
+Parallel primitives used by the scheduler. Two backends:
+- PPL (Concurrency Runtime), default with MSVC,
+- a portable std::thread pool, default elsewhere. Define MTOBJECTS_PORTABLE_BACKEND to use it with MSVC too.
+*/
+
+#if defined(_MSC_VER) && !defined(MTOBJECTS_PORTABLE_BACKEND)
+#define MTOBJECTS_USE_PPL 1
+#else
+#define MTOBJECTS_USE_PPL 0
+#endif
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+
+#if MTOBJECTS_USE_PPL
+#include <ppl.h>
+#include <ppltasks.h>
+#include <concurrent_queue.h>
+#include <concrt.h>
+#endif //MTOBJECTS_USE_PPL
+
+namespace MTObjects
+{
+namespace Parallel
+{
+#if MTOBJECTS_USE_PPL
+	static constexpr const char* kBackendName = "PPL";
+
+	template<typename T> using ConcurrentQueue = concurrency::concurrent_queue<T>;
+
+	class Backend
+	{
+		static bool& SchedulerAttached() { static bool value = false; return value; }
+	public:
+		static unsigned int NumThreads()
+		{
+			return concurrency::CurrentScheduler::Get() ? concurrency::CurrentScheduler::Get()->GetNumberOfVirtualProcessors() : std::thread::hardware_concurrency();
+		}
+
+		// Attaches a scheduler limited to num_threads to the calling thread. 0 means all hardware threads.
+		static void SetNumThreads(unsigned int num_threads)
+		{
+			if (SchedulerAttached())
+			{
+				concurrency::CurrentScheduler::Detach();
+				SchedulerAttached() = false;
+			}
+			if (num_threads)
+			{
+				concurrency::CurrentScheduler::Create(concurrency::SchedulerPolicy(2, concurrency::MinConcurrency, num_threads, concurrency::MaxConcurrency, num_threads));
+				SchedulerAttached() = true;
+			}
+		}
+	};
+
+	template<typename TIndex, typename TFunction> void For(TIndex begin, TIndex end, const TFunction& function)
+	{
+		concurrency::parallel_for<TIndex>(begin, end, function);
+	}
+
+	template<typename TIterator, typename TFunction> void ForEach(TIterator begin, TIterator end, const TFunction& function)
+	{
+		concurrency::parallel_for_each(begin, end, function);
+	}
+
+	// Runs the function on another thread, the returned object has to be waited for.
+	template<typename TFunction> auto CreateTask(TFunction function)
+	{
+		return concurrency::create_task(function);
+	}
+#else
+	static constexpr const char* kBackendName = "std::thread";
+
+	template<typename T> class ConcurrentQueue
+	{
+		std::mutex mutex_;
+		std::deque<T> queue_;
+	public:
+		void push(const T& value)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue_.push_back(value);
+		}
+
+		bool try_pop(T& out_value)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (queue_.empty())
+				return false;
+			out_value = queue_.front();
+			queue_.pop_front();
+			return true;
+		}
+
+		size_t unsafe_size() const
+		{
+			return queue_.size();
+		}
+	};
+
+	struct IJob
+	{
+		virtual void Work() = 0;
+	};
+
+	/*
+	Persistent workers. A job is published to all of them and the calling thread joins the work, the call returns when
+	every worker left the job. Jobs live on the caller's stack, so a dispatch doesn't allocate.
+	Nested calls (from inside a job) or calls while another thread dispatches run inline on the calling thread.
+	*/
+	class Backend
+	{
+		std::vector<std::thread> workers_;
+		std::mutex dispatch_mutex_;
+
+		std::mutex mutex_;
+		std::condition_variable job_published_;
+		std::condition_variable job_finished_;
+		IJob* job_ = nullptr;
+		unsigned long long job_generation_ = 0;
+		unsigned int workers_in_job_ = 0;
+		bool stop_ = false;
+
+		static bool& IsInsideJob() { thread_local bool value = false; return value; }
+
+		void WorkerLoop(unsigned long long seen_generation)
+		{
+			IsInsideJob() = true;
+			for (;;)
+			{
+				IJob* job = nullptr;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					job_published_.wait(lock, [&]() { return stop_ || job_generation_ != seen_generation; });
+					if (stop_)
+						return;
+					seen_generation = job_generation_;
+					job = job_;
+				}
+				job->Work();
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					workers_in_job_--;
+					if (0 == workers_in_job_)
+					{
+						job_finished_.notify_one();
+					}
+				}
+			}
+		}
+
+		void StartWorkers(unsigned int num_threads)
+		{
+			stop_ = false;
+			const unsigned int num_workers = std::max(1u, num_threads) - 1; // the caller is a worker too
+			for (unsigned int i = 0; i < num_workers; i++)
+			{
+				workers_.emplace_back([this, generation = job_generation_]() { WorkerLoop(generation); });
+			}
+		}
+
+		void StopWorkers()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			job_published_.notify_all();
+			for (auto& worker : workers_)
+			{
+				worker.join();
+			}
+			workers_.clear();
+		}
+
+		Backend()
+		{
+			StartWorkers(std::thread::hardware_concurrency());
+		}
+
+	public:
+		~Backend()
+		{
+			StopWorkers();
+		}
+		Backend(const Backend&) = delete;
+		Backend& operator=(const Backend&) = delete;
+
+		static Backend& Get() { static Backend instance; return instance; }
+
+		static unsigned int NumThreads()
+		{
+			return static_cast<unsigned int>(Get().workers_.size()) + 1;
+		}
+
+		// 0 means all hardware threads. Don't call it while a job runs.
+		static void SetNumThreads(unsigned int num_threads)
+		{
+			Backend& backend = Get();
+			std::lock_guard<std::mutex> dispatch_lock(backend.dispatch_mutex_);
+			backend.StopWorkers();
+			backend.StartWorkers(num_threads ? num_threads : std::thread::hardware_concurrency());
+		}
+
+		void Run(IJob& job)
+		{
+			std::unique_lock<std::mutex> dispatch_lock(dispatch_mutex_, std::try_to_lock);
+			if (IsInsideJob() || !dispatch_lock.owns_lock() || workers_.empty())
+			{
+				job.Work();
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				job_ = &job;
+				job_generation_++;
+				workers_in_job_ = static_cast<unsigned int>(workers_.size());
+			}
+			job_published_.notify_all();
+
+			IsInsideJob() = true;
+			job.Work();
+			IsInsideJob() = false;
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			job_finished_.wait(lock, [&]() { return 0 == workers_in_job_; });
+			job_ = nullptr;
+		}
+	};
+
+	template<typename TIndex, typename TFunction> void For(TIndex begin, TIndex end, const TFunction& function)
+	{
+		struct ForJob : public IJob
+		{
+			std::atomic<TIndex> next_;
+			TIndex end_;
+			const TFunction& function_;
+
+			ForJob(TIndex begin, TIndex end, const TFunction& function) : next_(begin), end_(end), function_(function) {}
+
+			void Work() override
+			{
+				for (TIndex idx = next_++; idx < end_; idx = next_++)
+				{
+					function_(idx);
+				}
+			}
+		};
+
+		if (begin >= end)
+			return;
+		ForJob job(begin, end, function);
+		Backend::Get().Run(job);
+	}
+
+	template<typename TIterator, typename TFunction> void ForEach(TIterator begin, TIterator end, const TFunction& function)
+	{
+		For<size_t>(0, static_cast<size_t>(std::distance(begin, end)), [&](size_t idx)
+		{
+			function(*(begin + idx));
+		});
+	}
+
+	class Task
+	{
+		std::thread thread_;
+	public:
+		template<typename TFunction> explicit Task(TFunction function) : thread_(function) {}
+		Task(Task&&) = default;
+		~Task() { if (thread_.joinable()) thread_.join(); }
+		void wait() { if (thread_.joinable()) thread_.join(); }
+	};
+
+	// Runs the function on another thread, the returned object has to be waited for.
+	template<typename TFunction> Task CreateTask(TFunction function)
+	{
+		return Task(function);
+	}
+#endif //MTOBJECTS_USE_PPL
+
+	inline unsigned int NumThreads() { return Backend::NumThreads(); }
+	inline void SetNumThreads(unsigned int num_threads) { Backend::SetNumThreads(num_threads); }
+}
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+namespace MTObjects
+{
+	/*
+	Thin wrapper over Linux perf_event_open. It counts only the calling thread, user space only.
+	On other platforms (or when perf events are not permitted) IsValid() returns false and all reads are 0.
+	*/
+	enum class EPerfEvent : unsigned char
+	{
+		Cycles,
+		Instructions,
+		L1DReadMisses,
+		LLCMisses,
+		DTLBLoadMisses,
+		BranchMisses,
+		Count
+	};
+
+	inline const char* ToString(EPerfEvent event)
+	{
+		switch (event)
+		{
+		case EPerfEvent::Cycles: return "cycles";
+		case EPerfEvent::Instructions: return "instructions";
+		case EPerfEvent::L1DReadMisses: return "L1-dcache-load-misses";
+		case EPerfEvent::LLCMisses: return "LLC-misses";
+		case EPerfEvent::DTLBLoadMisses: return "dTLB-load-misses";
+		case EPerfEvent::BranchMisses: return "branch-misses";
+		default: return "unknown";
+		}
+	}
+
+	namespace PerfStuff
+	{
+		// Returns -1 if the event can't be opened. Group members follow the leader, so only the leader starts disabled.
+		inline int OpenEvent(EPerfEvent event, int group_fd)
+		{
+#ifdef __linux__
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			switch (event)
+			{
+			case EPerfEvent::Cycles:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CPU_CYCLES;
+				break;
+			case EPerfEvent::Instructions:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+				break;
+			case EPerfEvent::L1DReadMisses:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			case EPerfEvent::LLCMisses:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CACHE_MISSES;
+				break;
+			case EPerfEvent::DTLBLoadMisses:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+			case EPerfEvent::BranchMisses:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+				break;
+			default:
+				return -1;
+			}
+			attr.disabled = (-1 == group_fd) ? 1 : 0;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+#else
+			(void)event;
+			(void)group_fd;
+			return -1;
+#endif //__linux__
+		}
+
+		inline void CloseEvent(int fd)
+		{
+#ifdef __linux__
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+#else
+			(void)fd;
+#endif //__linux__
+		}
+
+		inline void ControlEvent(int fd, bool enable, bool whole_group)
+		{
+#ifdef __linux__
+			if (fd >= 0)
+			{
+				const unsigned long flags = whole_group ? PERF_IOC_FLAG_GROUP : 0;
+				if (enable)
+				{
+					ioctl(fd, PERF_EVENT_IOC_RESET, flags);
+				}
+				ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, flags);
+			}
+#else
+			(void)fd;
+			(void)enable;
+			(void)whole_group;
+#endif //__linux__
+		}
+
+		inline uint64_t ReadEvent(int fd)
+		{
+			uint64_t value = 0;
+#ifdef __linux__
+			if (fd >= 0 && static_cast<ssize_t>(sizeof(value)) != read(fd, &value, sizeof(value)))
+			{
+				value = 0;
+			}
+#else
+			(void)fd;
+#endif //__linux__
+			return value;
+		}
+	}
+
+	class PerfCounter
+	{
+		int fd_ = -1;
+
+	public:
+		explicit PerfCounter(EPerfEvent event)
+			: fd_(PerfStuff::OpenEvent(event, -1))
+		{}
+
+		~PerfCounter()
+		{
+			PerfStuff::CloseEvent(fd_);
+		}
+
+		PerfCounter(const PerfCounter&) = delete;
+		PerfCounter& operator=(const PerfCounter&) = delete;
+
+		bool IsValid() const { return fd_ >= 0; }
+		void Start() { PerfStuff::ControlEvent(fd_, true, false); }
+		void Stop() { PerfStuff::ControlEvent(fd_, false, false); }
+		uint64_t Read() const { return PerfStuff::ReadEvent(fd_); }
+	};
+
+	struct PerfSample
+	{
+		std::array<uint64_t, static_cast<size_t>(EPerfEvent::Count)> values_ = {};
+
+		uint64_t Get(EPerfEvent event) const { return values_[static_cast<size_t>(event)]; }
+
+		PerfSample& operator+=(const PerfSample& other)
+		{
+			for (size_t i = 0; i < values_.size(); i++)
+			{
+				values_[i] += other.values_[i];
+			}
+			return *this;
+		}
+	};
+
+	/*
+	All events of EPerfEvent scheduled together, so the ratios between them (CPI, misses per instruction) are consistent.
+	Events the CPU (or VM) doesn't support are skipped, IsValid(event) tells which ones are counted.
+	*/
+	class PerfCounterGroup
+	{
+		std::array<int, static_cast<size_t>(EPerfEvent::Count)> fds_;
+		int leader_fd_ = -1;
+
+	public:
+		PerfCounterGroup()
+		{
+			fds_.fill(-1);
+			for (size_t i = 0; i < fds_.size(); i++)
+			{
+				fds_[i] = PerfStuff::OpenEvent(static_cast<EPerfEvent>(i), leader_fd_);
+				if (-1 == leader_fd_)
+				{
+					leader_fd_ = fds_[i];
+				}
+			}
+		}
+
+		~PerfCounterGroup()
+		{
+			// members first, the leader last
+			for (int fd : fds_)
+			{
+				if (fd != leader_fd_)
+				{
+					PerfStuff::CloseEvent(fd);
+				}
+			}
+			PerfStuff::CloseEvent(leader_fd_);
+		}
+
+		PerfCounterGroup(const PerfCounterGroup&) = delete;
+		PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+		bool IsValid() const { return leader_fd_ >= 0; }
+		bool IsValid(EPerfEvent event) const { return fds_[static_cast<size_t>(event)] >= 0; }
+		void Start() { PerfStuff::ControlEvent(leader_fd_, true, true); }
+		void Stop() { PerfStuff::ControlEvent(leader_fd_, false, true); }
+
+		PerfSample Read() const
+		{
+			PerfSample sample;
+			for (size_t i = 0; i < fds_.size(); i++)
+			{
+				sample.values_[i] = PerfStuff::ReadEvent(fds_[i]);
+			}
+			return sample;
+		}
+	};
+}
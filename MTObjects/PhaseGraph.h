@@ -0,0 +1,249 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include <memory>
+
+namespace MTObjects
+{
+/*
+Frame graph of several phases (e.g. physics, AI, animation) over one clustering. Every object runs
+IThreadSafeObject::PhaseTask(phase) for phase 0 .. num_phases-1, its dependencies cover all of them.
+The reference order is the phases one after another, each one executed like FrameScheduler::Execute: tier after tier, group after group.
+Instead of a barrier per phase and per group, every (cluster, phase) node counts the nodes it has to wait for:
+- the previous phase of the same cluster,
+- in the same phase, the conflicting clusters (const dependencies, either direction) that come first in the reference order,
+- in the previous phase, the conflicting clusters that come later.
+A finished node releases its successors, a cluster starts the next phase as soon as its neighbourhood is done with the
+current one. The result is the same as with the reference order.
+With an enabled deadline, clusters of a deferrable priority that haven't started phase 0 before it are deferred (all phases).
+A worker that finds no ready node parks on ready_version_, which changes on every push and when the last node finishes.
+*/
+class PhaseGraph
+{
+public:
+	static const constexpr unsigned int kMaxPhases = 8;
+	static const constexpr unsigned int kMaxNodes = kMaxClusters * kMaxPhases;
+
+private:
+	static const constexpr uint32_t kNotReady = ~0u;
+
+	vector<IndexSet> conflicts_; // symmetric closure of the dependency sets
+	std::unique_ptr<Cluster*[]> clusters_;
+	std::unique_ptr<unsigned int[]> slots_; // position of the cluster in the reference order of a phase
+	std::unique_ptr<EPriority[]> priorities_;
+	std::unique_ptr<std::atomic<unsigned int>[]> pending_; // node = phase * num_clusters_ + cluster
+	// Every node is pushed exactly once per frame, so the ready queue is an array without wrap-around.
+	std::unique_ptr<std::atomic<uint32_t>[]> ready_;
+	alignas(64) std::atomic<unsigned int> ready_push_ = { 0 };
+	alignas(64) std::atomic<unsigned int> ready_pop_ = { 0 };
+	alignas(64) std::atomic<unsigned int> num_unfinished_ = { 0 };
+	GroupWorkerPoolStuff::ParkingWord ready_version_;
+	unsigned int num_clusters_ = 0;
+	unsigned int num_phases_ = 0;
+
+	void Push(uint32_t node)
+	{
+		const unsigned int idx = ready_push_.fetch_add(1, std::memory_order_relaxed);
+		Assert(idx < num_clusters_ * num_phases_);
+		ready_[idx].store(node, std::memory_order_release);
+		ready_version_.Increment();
+	}
+
+	bool TryPop(uint32_t& out_node)
+	{
+		unsigned int idx = ready_pop_.load(std::memory_order_relaxed);
+		do
+		{
+			if (idx >= ready_push_.load(std::memory_order_acquire))
+				return false;
+		} while (!ready_pop_.compare_exchange_weak(idx, idx + 1, std::memory_order_relaxed));
+		// The slot is reserved, the push may not be visible yet
+		while (kNotReady == (out_node = ready_[idx].load(std::memory_order_acquire)))
+		{
+			CpuRelax();
+		}
+		return true;
+	}
+
+	void Release(unsigned int node)
+	{
+		if (1 == pending_[node].fetch_sub(1, std::memory_order_acq_rel))
+		{
+			Push(node);
+		}
+	}
+
+	void Complete(unsigned int cluster_idx, unsigned int phase)
+	{
+		using BitMatrixStuff::ForEachSetBit;
+		const bool has_next_phase = phase + 1 < num_phases_;
+		if (has_next_phase)
+		{
+			Release((phase + 1) * num_clusters_ + cluster_idx);
+		}
+		const unsigned int slot = slots_[cluster_idx];
+		ForEachSetBit(conflicts_[cluster_idx], 0, num_clusters_, [&](unsigned int other)
+		{
+			if (slots_[other] > slot)
+			{
+				Release(phase * num_clusters_ + other);
+			}
+			else if (has_next_phase)
+			{
+				Release((phase + 1) * num_clusters_ + other);
+			}
+		});
+		if (1 == num_unfinished_.fetch_sub(1, std::memory_order_acq_rel))
+		{
+			ready_version_.Increment();
+		}
+	}
+
+	// Returns false when every node is finished.
+	bool WaitPop(uint32_t& out_node, unsigned int spin_count)
+	{
+		for (;;)
+		{
+			const uint32_t version = ready_version_.Load();
+			if (TryPop(out_node))
+				return true;
+			if (0 == num_unfinished_.load(std::memory_order_acquire))
+				return false;
+			ready_version_.Wait(version, spin_count);
+		}
+	}
+
+	void RunNode(unsigned int cluster_idx, unsigned int phase, FrameDeadline& deadline, unsigned int prefetch_distance)
+	{
+		Cluster* cluster = clusters_[cluster_idx];
+		if (0 == phase && deadline.IsDeferrable(priorities_[cluster_idx]) && deadline.HasPassed())
+		{
+			GroupOfConcurrentClusters::DeferCluster(cluster, deadline); // the later phases find it empty
+			return;
+		}
+		MTO_TRACE_SCOPE_ARG("ClusterPhase", "phase", phase);
+		const bool last_phase = phase + 1 == num_phases_;
+		cluster->ForEachObject(prefetch_distance, [phase, last_phase](IThreadSafeObject* obj)
+		{
+			obj->PhaseTask(phase);
+			if (last_phase)
+			{
+				obj->SetClusterIndex(kNullIndex);
+				obj->deferred_ = false;
+			}
+		});
+		IF_TELEMETRY(Telemetry::Add(EStat::ObjectsExecuted, cluster->GetObjects().size()));
+		if (last_phase)
+		{
+			IF_TELEMETRY(Telemetry::Add(EStat::ClustersExecuted, 1));
+			cluster->Reset<true>();
+		}
+	}
+
+public:
+	PhaseGraph()
+		: clusters_(new Cluster*[kMaxClusters])
+		, slots_(new unsigned int[kMaxClusters])
+		, priorities_(new EPriority[kMaxClusters])
+		, pending_(new std::atomic<unsigned int>[kMaxNodes])
+		, ready_(new std::atomic<uint32_t>[kMaxNodes])
+	{
+		conflicts_.reserve(kMaxClusters);
+	}
+	PhaseGraph(const PhaseGraph&) = delete;
+	PhaseGraph& operator=(const PhaseGraph&) = delete;
+
+	// The groups have to be the ones generated from the dependency sets.
+	void Build(ClusterArray& clusters, const vector<IndexSet>& dependency_sets, const vector<EPriority>& cluster_priorities,
+		const vector<GroupOfConcurrentClusters>& groups, unsigned int num_groups, unsigned int num_phases)
+	{
+		using BitMatrixStuff::ForEachSetBit;
+		Assert(num_phases && num_phases <= kMaxPhases);
+		num_clusters_ = static_cast<unsigned int>(dependency_sets.size());
+		num_phases_ = num_phases;
+
+		conflicts_.assign(num_clusters_, IndexSet());
+		for (unsigned int cluster_idx = 0; cluster_idx < num_clusters_; cluster_idx++)
+		{
+			clusters_[cluster_idx] = &clusters[cluster_idx];
+			priorities_[cluster_idx] = cluster_priorities[cluster_idx];
+			conflicts_[cluster_idx] |= dependency_sets[cluster_idx];
+			ForEachSetBit(dependency_sets[cluster_idx], 0, num_clusters_, [&](unsigned int dependency)
+			{
+				conflicts_[dependency][cluster_idx] = true;
+			});
+		}
+		for (unsigned int tier_idx = 0; tier_idx < kNumPriorities; tier_idx++)
+		{
+			for (unsigned int group_idx = 0; group_idx < num_groups; group_idx++)
+			{
+				for (Cluster* cluster : groups[group_idx].GetTier(static_cast<EPriority>(tier_idx)))
+				{
+					slots_[cluster - &clusters[0]] = tier_idx * num_groups + group_idx;
+				}
+			}
+		}
+
+		// Phase 0 waits only for the earlier conflicts, the later phases for all of them and the own previous phase.
+		ready_push_.store(0, std::memory_order_relaxed);
+		ready_pop_.store(0, std::memory_order_relaxed);
+		for (unsigned int node = 0; node < num_clusters_ * num_phases_; node++)
+		{
+			ready_[node].store(kNotReady, std::memory_order_relaxed);
+		}
+		for (unsigned int cluster_idx = 0; cluster_idx < num_clusters_; cluster_idx++)
+		{
+			const unsigned int slot = slots_[cluster_idx];
+			unsigned int num_earlier = 0;
+			ForEachSetBit(conflicts_[cluster_idx], 0, num_clusters_, [&](unsigned int other)
+			{
+				Assert(slots_[other] != slot);
+				num_earlier += (slots_[other] < slot) ? 1 : 0;
+			});
+			const unsigned int num_conflicts = static_cast<unsigned int>(conflicts_[cluster_idx].count());
+			pending_[cluster_idx].store(num_earlier, std::memory_order_relaxed);
+			for (unsigned int phase = 1; phase < num_phases_; phase++)
+			{
+				pending_[phase * num_clusters_ + cluster_idx].store(1 + num_conflicts, std::memory_order_relaxed);
+			}
+		}
+		// The first ready nodes in the reference order, the Critical tiers first
+		for (unsigned int tier_idx = 0; tier_idx < kNumPriorities; tier_idx++)
+		{
+			for (unsigned int group_idx = 0; group_idx < num_groups; group_idx++)
+			{
+				for (Cluster* cluster : groups[group_idx].GetTier(static_cast<EPriority>(tier_idx)))
+				{
+					const unsigned int cluster_idx = static_cast<unsigned int>(cluster - &clusters[0]);
+					if (0 == pending_[cluster_idx].load(std::memory_order_relaxed))
+					{
+						Push(cluster_idx);
+					}
+				}
+			}
+		}
+		num_unfinished_.store(num_clusters_ * num_phases_, std::memory_order_relaxed);
+	}
+
+	// Runs all the nodes, call once after Build. See Cluster::ForEachObject for the prefetch distance.
+	void Execute(FrameDeadline& deadline, unsigned int prefetch_distance)
+	{
+		const unsigned int num_workers = std::min(Parallel::NumThreads(), num_clusters_);
+		// Spinning with more workers than hardware threads would only steal time from the running nodes.
+		const unsigned int spin_count = (num_workers <= std::max(1u, std::thread::hardware_concurrency())) ? GroupWorkerPool::kDefaultSpinCount : 0;
+		Parallel::For<unsigned int>(0, num_workers, [this, &deadline, prefetch_distance, spin_count](unsigned int)
+		{
+			uint32_t node = kNotReady;
+			while (WaitPop(node, spin_count))
+			{
+				const unsigned int phase = node / num_clusters_;
+				const unsigned int cluster_idx = node % num_clusters_;
+				RunNode(cluster_idx, phase, deadline, prefetch_distance);
+				Complete(cluster_idx, phase);
+			}
+		});
+	}
+
+	unsigned int GetNumPhases() const { return num_phases_; }
+};
+}
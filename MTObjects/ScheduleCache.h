@@ -0,0 +1,173 @@
+#pragma once
+
+#include "IThreadSafeObject.h"
+#include <array>
+#include <vector>
+#include <cstdint>
+
+namespace MTObjects
+{
+	/*
+	Remembers the schedules (cluster membership, cluster dependencies and priorities, and the group plan) of the last few dependency graphs.
+	The key of a graph is a commutative sum of per-object fingerprints, so it doesn't depend on the order of the objects.
+	An object either returns its own fingerprint (IThreadSafeObject::GetDependencyFingerprint, it can be kept up to date
+	incrementally by the object), or the fingerprint is computed from IsDependentOn and GetConstDependencies.
+	Objects that implement neither GetDependencyFingerprint nor GetConstDependencies must not change their const dependencies
+	while the cache is used, such a change is not detected. The same holds for IThreadSafeObject::GetPriority.
+	*/
+	class ScheduleCache
+	{
+	public:
+		static const constexpr unsigned int kNumEntries = 4;
+
+		struct Entry
+		{
+			uint64_t key_ = 0;
+			uint64_t last_used_ = 0; // 0 - empty entry
+			size_t num_objects_ = 0;
+			vector<IThreadSafeObject*> objects_;	// cluster after cluster
+			vector<uint32_t> cluster_offsets_;		// num_clusters + 1
+			vector<IndexSet> dependency_sets_;
+			vector<EPriority> cluster_priorities_;
+			vector<TClusterIndex> group_clusters_;	// group after group
+			vector<uint32_t> group_offsets_;		// num_groups + 1
+
+			unsigned int GetNumClusters() const { return static_cast<unsigned int>(dependency_sets_.size()); }
+			unsigned int GetNumGroups() const { return group_offsets_.empty() ? 0 : static_cast<unsigned int>(group_offsets_.size() - 1); }
+		};
+
+	private:
+		std::array<Entry, kNumEntries> entries_;
+		uint64_t use_counter_ = 0;
+		uint64_t num_lookups_ = 0;
+		uint64_t num_hits_ = 0;
+		vector<const IThreadSafeObject*> const_dependencies_;
+
+		static uint64_t Mix(uint64_t value)
+		{
+			// splitmix64 finalizer
+			value += 0x9E3779B97F4A7C15ull;
+			value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+			value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+			return value ^ (value >> 31);
+		}
+
+		static const constexpr uint64_t kDependencyPrime = 0x100000001B3ull;
+		static const constexpr uint64_t kConstDependencyPrime = 0x9E3779B1ull;
+
+	public:
+		ScheduleCache()
+		{
+			for (auto& entry : entries_)
+			{
+				entry.dependency_sets_.reserve(kMaxClusters);
+				entry.cluster_priorities_.reserve(kMaxClusters);
+				entry.cluster_offsets_.reserve(kMaxClusters + 1);
+				entry.group_clusters_.reserve(kMaxClusters);
+				entry.group_offsets_.reserve(kMaxClusters + 1);
+			}
+		}
+
+		// The pool is used only for temporary containers. Not thread safe.
+		uint64_t ComputeKey(const vector<IThreadSafeObject*>& all_objects, ChunkMemoryPool& pool)
+		{
+			uint64_t key = Mix(static_cast<uint64_t>(all_objects.size()));
+			FastContainer<IThreadSafeObject*> dependencies(pool);
+			for (auto obj : all_objects)
+			{
+				uint64_t fingerprint = obj->GetDependencyFingerprint();
+				if (0 == fingerprint)
+				{
+					fingerprint = reinterpret_cast<uintptr_t>(obj);
+					obj->IsDependentOn(dependencies);
+					for (auto dependency : dependencies)
+					{
+						fingerprint = fingerprint * kDependencyPrime + reinterpret_cast<uintptr_t>(dependency);
+					}
+					dependencies.clear<false>();
+
+					obj->GetConstDependencies(const_dependencies_);
+					for (auto dependency : const_dependencies_)
+					{
+						fingerprint = fingerprint * kConstDependencyPrime + reinterpret_cast<uintptr_t>(dependency);
+					}
+					const_dependencies_.clear();
+				}
+				// Mixed, so a sum of fingerprints doesn't cancel out
+				key += Mix(fingerprint);
+			}
+			return key;
+		}
+
+		// Returns nullptr on a miss
+		const Entry* Find(uint64_t key, size_t num_objects)
+		{
+			num_lookups_++;
+			for (auto& entry : entries_)
+			{
+				if (entry.last_used_ && entry.key_ == key && entry.num_objects_ == num_objects)
+				{
+					entry.last_used_ = ++use_counter_;
+					num_hits_++;
+					return &entry;
+				}
+			}
+			return nullptr;
+		}
+
+		// Replaces the least recently used entry. Allocates only until the entries' buffers are big enough.
+		void Store(uint64_t key, size_t num_objects, const ClusterArray& clusters, const vector<IndexSet>& dependency_sets,
+			const vector<EPriority>& cluster_priorities, const vector<GroupOfConcurrentClusters>& groups, unsigned int num_groups)
+		{
+			Entry* entry = &entries_[0];
+			for (auto& candidate : entries_)
+			{
+				if (candidate.last_used_ < entry->last_used_)
+				{
+					entry = &candidate;
+				}
+			}
+			entry->key_ = key;
+			entry->last_used_ = ++use_counter_;
+			entry->num_objects_ = num_objects;
+			entry->dependency_sets_.assign(dependency_sets.begin(), dependency_sets.end());
+			entry->cluster_priorities_.assign(cluster_priorities.begin(), cluster_priorities.end());
+
+			entry->objects_.clear();
+			entry->objects_.reserve(num_objects);
+			entry->cluster_offsets_.clear();
+			for (unsigned int cluster_idx = 0; cluster_idx < dependency_sets.size(); cluster_idx++)
+			{
+				entry->cluster_offsets_.push_back(static_cast<uint32_t>(entry->objects_.size()));
+				for (auto obj : clusters[cluster_idx].GetObjects())
+				{
+					entry->objects_.push_back(obj);
+				}
+			}
+			entry->cluster_offsets_.push_back(static_cast<uint32_t>(entry->objects_.size()));
+
+			entry->group_clusters_.clear();
+			entry->group_offsets_.clear();
+			for (unsigned int group_idx = 0; group_idx < num_groups; group_idx++)
+			{
+				entry->group_offsets_.push_back(static_cast<uint32_t>(entry->group_clusters_.size()));
+				for (auto cluster : groups[group_idx].clusters_)
+				{
+					entry->group_clusters_.push_back(static_cast<TClusterIndex>(cluster - &clusters[0]));
+				}
+			}
+			entry->group_offsets_.push_back(static_cast<uint32_t>(entry->group_clusters_.size()));
+		}
+
+		void Clear()
+		{
+			for (auto& entry : entries_)
+			{
+				entry.last_used_ = 0;
+			}
+		}
+
+		uint64_t GetNumLookups() const { return num_lookups_; }
+		uint64_t GetNumHits() const { return num_hits_; }
+	};
+}
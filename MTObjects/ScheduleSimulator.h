@@ -0,0 +1,301 @@
+#pragma once
+
+#include "FrameScheduler.h"
+#include <functional>
+
+namespace MTObjects
+{
+	// A tier of a group: what FrameScheduler::Execute runs between two barriers.
+	struct SimulatedStep
+	{
+		unsigned int group_ = 0;
+		EPriority tier_ = EPriority::Normal;
+		unsigned int num_clusters_ = 0;
+		double work_ = 0.0; // sum of the cluster costs
+		double max_cluster_ = 0.0;
+	};
+
+	// One virtual worker count. Times are in the units of the cluster costs.
+	struct SimulatedWorkers
+	{
+		unsigned int num_workers_ = 0;
+		double groups_makespan_ = 0.0; // Execute: the steps one after another, a barrier after every step
+		double graph_makespan_ = 0.0; // no barriers, a cluster waits only for the conflicting clusters before it (ExecutePhases with one phase)
+		double groups_speedup_ = 0.0; // total work / makespan
+		double graph_speedup_ = 0.0;
+		double utilization_ = 0.0; // total work / (workers * groups_makespan_)
+		vector<float> step_utilization_; // per step: its work / (workers * its makespan)
+	};
+
+	struct ScheduleSimulation
+	{
+		unsigned int num_clusters_ = 0;
+		double total_work_ = 0.0; // the makespan of a single worker
+		double barrier_cost_ = 0.0; // added to every step when there is more than one worker
+		double groups_critical_path_ = 0.0; // Execute with unlimited workers: the most expensive cluster of every step, and the barriers
+		double graph_critical_path_ = 0.0; // without barriers with unlimited workers: the most expensive chain of conflicting clusters
+		vector<unsigned int> critical_chain_; // the clusters of graph_critical_path_, in execution order
+		vector<SimulatedStep> steps_;
+		vector<SimulatedWorkers> workers_;
+
+		// Nothing beats these, whatever the number of cores.
+		double GetGroupsSpeedupCeiling() const { return groups_critical_path_ > 0.0 ? total_work_ / groups_critical_path_ : 0.0; }
+		double GetGraphSpeedupCeiling() const { return graph_critical_path_ > 0.0 ? total_work_ / graph_critical_path_ : 0.0; }
+	};
+
+	/*
+	What-if analysis of a frame without running it: the makespan of the clusters of the last GenerateClusterGroups for any number
+	of virtual workers, given a cost per cluster. Two executors are simulated:
+	- groups: FrameScheduler::Execute. The (tier, group) steps run in order, the clusters of a step are claimed in order by the
+	  first free worker, every step ends with a barrier.
+	- graph: a cluster starts as soon as the conflicting clusters (const dependencies, either direction) before it in the
+	  order of Execute are done, as PhaseGraph does. The gap between the two is the price of the barriers.
+	The critical paths give the speedup ceilings: when the ceiling is close to the speedup at the current worker count, more
+	cores won't help, only a dependency structure with smaller clusters or shorter chains will.
+	Costs come from GetMeasuredClusterCosts (ns recorded by the executed frame) or EstimateClusterCosts (IThreadSafeObject::GetCost).
+	Nothing runs a Task() here.
+	*/
+	class ScheduleSimulator
+	{
+	public:
+		static const constexpr unsigned int kMaxWorkers = 128;
+
+	private:
+		vector<double> costs_;
+		vector<unsigned int> order_; // clusters in the order of Execute
+		vector<unsigned int> step_begin_; // into order_, per step + 1
+		vector<unsigned int> slots_; // per cluster, the index of its step
+		vector<IndexSet> conflicts_;
+		vector<SimulatedStep> steps_;
+
+		double SimulateStep(unsigned int step_idx, unsigned int num_workers, vector<double>& free_at) const
+		{
+			// free_at is a min-heap of the times the workers are free at
+			free_at.assign(num_workers, 0.0);
+			double makespan = 0.0;
+			for (unsigned int idx = step_begin_[step_idx]; idx < step_begin_[step_idx + 1]; idx++)
+			{
+				std::pop_heap(free_at.begin(), free_at.end(), std::greater<double>());
+				free_at.back() += costs_[order_[idx]];
+				makespan = std::max(makespan, free_at.back());
+				std::push_heap(free_at.begin(), free_at.end(), std::greater<double>());
+			}
+			return makespan;
+		}
+
+		double SimulateGraph(unsigned int num_workers) const
+		{
+			using BitMatrixStuff::ForEachSetBit;
+			const unsigned int num_clusters = static_cast<unsigned int>(costs_.size());
+			vector<unsigned int> pending(num_clusters, 0);
+			vector<unsigned int> ready;
+			ready.reserve(num_clusters);
+			for (unsigned int cluster_idx : order_)
+			{
+				ForEachSetBit(conflicts_[cluster_idx], 0, num_clusters, [&](unsigned int other)
+				{
+					pending[cluster_idx] += (slots_[other] < slots_[cluster_idx]) ? 1 : 0;
+				});
+				if (0 == pending[cluster_idx])
+				{
+					ready.push_back(cluster_idx);
+				}
+			}
+			// (finish time, cluster) of the running clusters, a min-heap
+			using Running = std::pair<double, unsigned int>;
+			vector<Running> running;
+			running.reserve(num_workers);
+			size_t next_ready = 0;
+			double time = 0.0;
+			while (next_ready < ready.size() || !running.empty())
+			{
+				while (running.size() < num_workers && next_ready < ready.size())
+				{
+					const unsigned int cluster_idx = ready[next_ready++];
+					running.push_back({ time + costs_[cluster_idx], cluster_idx });
+					std::push_heap(running.begin(), running.end(), std::greater<Running>());
+				}
+				std::pop_heap(running.begin(), running.end(), std::greater<Running>());
+				const Running done = running.back();
+				running.pop_back();
+				time = done.first;
+				ForEachSetBit(conflicts_[done.second], 0, num_clusters, [&](unsigned int other)
+				{
+					if (slots_[other] > slots_[done.second] && 0 == --pending[other])
+					{
+						ready.push_back(other);
+					}
+				});
+			}
+			Assert(ready.size() == num_clusters);
+			return time;
+		}
+
+	public:
+		// Right after GenerateClusterGroups, the costs can be set later, see SetClusterCosts.
+		void Build(const FrameScheduler& scheduler)
+		{
+			using BitMatrixStuff::ForEachSetBit;
+			const unsigned int num_clusters = scheduler.GetNumClusters();
+			const Cluster* const first_cluster = &scheduler.GetClusters()[0];
+			costs_.assign(num_clusters, 0.0);
+			order_.clear();
+			step_begin_.assign(1, 0);
+			slots_.assign(num_clusters, 0);
+			steps_.clear();
+			for (unsigned int tier_idx = 0; tier_idx < kNumPriorities; tier_idx++)
+			{
+				for (unsigned int group_idx = 0; group_idx < scheduler.GetNumGroups(); group_idx++)
+				{
+					const ClusterSpan tier = scheduler.GetGroup(group_idx).GetTier(static_cast<EPriority>(tier_idx));
+					if (tier.empty())
+						continue;
+					SimulatedStep step;
+					step.group_ = group_idx;
+					step.tier_ = static_cast<EPriority>(tier_idx);
+					step.num_clusters_ = tier.size();
+					for (const Cluster* cluster : tier)
+					{
+						const unsigned int cluster_idx = static_cast<unsigned int>(cluster - first_cluster);
+						slots_[cluster_idx] = static_cast<unsigned int>(steps_.size());
+						order_.push_back(cluster_idx);
+					}
+					steps_.push_back(step);
+					step_begin_.push_back(static_cast<unsigned int>(order_.size()));
+				}
+			}
+			Assert(order_.size() == num_clusters);
+
+			const vector<IndexSet>& dependency_sets = scheduler.GetDependencySets();
+			conflicts_.assign(num_clusters, IndexSet());
+			for (unsigned int cluster_idx = 0; cluster_idx < num_clusters; cluster_idx++)
+			{
+				conflicts_[cluster_idx] |= dependency_sets[cluster_idx];
+				ForEachSetBit(dependency_sets[cluster_idx], 0, num_clusters, [&](unsigned int dependency)
+				{
+					conflicts_[dependency][cluster_idx] = true;
+				});
+			}
+		}
+
+		// A cost per cluster of the built frame.
+		void SetClusterCosts(const vector<double>& cluster_costs)
+		{
+			Assert(cluster_costs.size() == costs_.size());
+			costs_ = cluster_costs;
+			for (unsigned int step_idx = 0; step_idx < steps_.size(); step_idx++)
+			{
+				SimulatedStep& step = steps_[step_idx];
+				step.work_ = 0.0;
+				step.max_cluster_ = 0.0;
+				for (unsigned int idx = step_begin_[step_idx]; idx < step_begin_[step_idx + 1]; idx++)
+				{
+					step.work_ += costs_[order_[idx]];
+					step.max_cluster_ = std::max(step.max_cluster_, costs_[order_[idx]]);
+				}
+			}
+		}
+
+		// barrier_cost is added to every step when there is more than one worker. Worker counts above kMaxWorkers are clamped.
+		ScheduleSimulation Simulate(const vector<unsigned int>& worker_counts, double barrier_cost = 0.0) const
+		{
+			using BitMatrixStuff::ForEachSetBit;
+			const unsigned int num_clusters = static_cast<unsigned int>(costs_.size());
+			ScheduleSimulation simulation;
+			simulation.num_clusters_ = num_clusters;
+			simulation.barrier_cost_ = barrier_cost;
+			simulation.steps_ = steps_;
+			for (const SimulatedStep& step : steps_)
+			{
+				simulation.total_work_ += step.work_;
+				simulation.groups_critical_path_ += step.max_cluster_ + barrier_cost;
+			}
+
+			// The longest chain, clusters in the order of Execute: every conflict points forward
+			vector<double> finish(num_clusters, 0.0);
+			vector<unsigned int> predecessor(num_clusters, kNullIndex);
+			unsigned int last = kNullIndex;
+			for (unsigned int cluster_idx : order_)
+			{
+				double start = 0.0;
+				ForEachSetBit(conflicts_[cluster_idx], 0, num_clusters, [&](unsigned int other)
+				{
+					if (slots_[other] < slots_[cluster_idx] && finish[other] > start)
+					{
+						start = finish[other];
+						predecessor[cluster_idx] = other;
+					}
+				});
+				finish[cluster_idx] = start + costs_[cluster_idx];
+				if (kNullIndex == last || finish[cluster_idx] > finish[last])
+				{
+					last = cluster_idx;
+				}
+			}
+			for (unsigned int cluster_idx = last; kNullIndex != cluster_idx; cluster_idx = predecessor[cluster_idx])
+			{
+				simulation.critical_chain_.push_back(cluster_idx);
+			}
+			std::reverse(simulation.critical_chain_.begin(), simulation.critical_chain_.end());
+			simulation.graph_critical_path_ = (kNullIndex == last) ? 0.0 : finish[last];
+
+			vector<double> free_at;
+			for (unsigned int num_workers : worker_counts)
+			{
+				SimulatedWorkers workers;
+				workers.num_workers_ = std::min(std::max(num_workers, 1u), kMaxWorkers);
+				const double step_barrier = workers.num_workers_ > 1 ? barrier_cost : 0.0;
+				for (unsigned int step_idx = 0; step_idx < steps_.size(); step_idx++)
+				{
+					const double step_makespan = SimulateStep(step_idx, workers.num_workers_, free_at) + step_barrier;
+					workers.groups_makespan_ += step_makespan;
+					workers.step_utilization_.push_back(step_makespan > 0.0 ? static_cast<float>(steps_[step_idx].work_ / (workers.num_workers_ * step_makespan)) : 0.0f);
+				}
+				workers.graph_makespan_ = SimulateGraph(workers.num_workers_);
+				if (workers.groups_makespan_ > 0.0)
+				{
+					workers.groups_speedup_ = simulation.total_work_ / workers.groups_makespan_;
+					workers.utilization_ = simulation.total_work_ / (workers.num_workers_ * workers.groups_makespan_);
+				}
+				workers.graph_speedup_ = workers.graph_makespan_ > 0.0 ? simulation.total_work_ / workers.graph_makespan_ : 0.0;
+				simulation.workers_.push_back(std::move(workers));
+			}
+			return simulation;
+		}
+
+		// 1, 2, 4 .. kMaxWorkers
+		static vector<unsigned int> GetDefaultWorkerCounts()
+		{
+			vector<unsigned int> worker_counts;
+			for (unsigned int num_workers = 1; num_workers <= kMaxWorkers; num_workers *= 2)
+			{
+				worker_counts.push_back(num_workers);
+			}
+			return worker_counts;
+		}
+
+		// Sum of IThreadSafeObject::GetCost of the objects of every cluster, an object without a cost counts as 1.
+		static vector<double> EstimateClusterCosts(const FrameScheduler& scheduler)
+		{
+			vector<double> costs(scheduler.GetNumClusters(), 0.0);
+			for (unsigned int cluster_idx = 0; cluster_idx < scheduler.GetNumClusters(); cluster_idx++)
+			{
+				for (const IThreadSafeObject* obj : scheduler.GetClusters()[cluster_idx].GetObjects())
+				{
+					costs[cluster_idx] += std::max(obj->GetCost(), 1u);
+				}
+			}
+			return costs;
+		}
+
+		/*
+		The time of every cluster [ns] in the last Execute, recorded with FrameScheduler::EnableClusterTiming. The clusters ran
+		in parallel with the rest of the frame, so the times include its contention. Deferred clusters cost 0.
+		*/
+		static vector<double> GetMeasuredClusterCosts(const FrameScheduler& scheduler)
+		{
+			const vector<float>& times = scheduler.GetClusterTimes();
+			return vector<double>(times.begin(), times.end());
+		}
+	};
+}
@@ -0,0 +1,512 @@
+#pragma once
+
+#include "FrameScheduler.h"
+#include <unordered_map>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+Multi-process sharding, Linux only (fork and a shared anonymous mapping). The objects are split into shards by their clusters,
+so objects connected by mutable dependencies always share a shard. Every shard runs in its own process with its own FrameScheduler.
+Const dependencies may cross shards: the reading shard keeps a mirror of the remote object (its copy inherited through fork),
+refreshed through a shared-memory ring after every frame. A cross-shard read sees the state of the previous frame.
+The groups of different shards are generated independently and don't line up, so the frame is the common exchange point,
+not the group boundaries. The sharded benchmark checks these semantics against the same frames run in one process
+(RunShardedReference in Benchmark.h).
+
+Objects of a sharded world:
+- skip const dependencies with a kNullIndex cluster index in IsConstDependentOn, those are the remote ones,
+- report their const dependencies with GetConstDependencies,
+- serialize the state read by other shards with WriteSharedState / ReadSharedState.
+*/
+namespace MTObjects
+{
+namespace Sharding
+{
+	static const constexpr unsigned int kMaxShards = 64;
+
+	struct alignas(64) StateRecord
+	{
+		uint32_t object_idx_ = 0;
+		uint32_t size_ = 0;
+		unsigned char data_[IThreadSafeObject::kMaxSharedStateSize];
+	};
+	static_assert(sizeof(StateRecord) == 64, "a record is one cache line");
+
+	struct alignas(64) SharedCursor
+	{
+		std::atomic<uint64_t> value_ = { 0 };
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "the cursors are shared between processes");
+
+	/*
+	Single producer, single consumer ring of state records. It lives in shared memory and the cursors are lock-free atomics,
+	so the producer and the consumer may be different processes. The capacity is a power of two.
+	*/
+	class StateRing
+	{
+		SharedCursor* head_ = nullptr; // next record to read, written by the consumer
+		SharedCursor* tail_ = nullptr; // next record to write, written by the producer
+		StateRecord* records_ = nullptr;
+		uint32_t capacity_ = 0;
+
+	public:
+		static size_t GetMemorySize(uint32_t capacity) { return 2 * sizeof(SharedCursor) + capacity * sizeof(StateRecord); }
+
+		void Bind(void* memory, uint32_t capacity)
+		{
+			Assert(capacity && 0 == (capacity & (capacity - 1)));
+			head_ = new (memory) SharedCursor();
+			tail_ = new (head_ + 1) SharedCursor();
+			records_ = reinterpret_cast<StateRecord*>(tail_ + 1);
+			capacity_ = capacity;
+		}
+
+		bool TryPush(const StateRecord& record)
+		{
+			const uint64_t tail = tail_->value_.load(std::memory_order_relaxed);
+			if (tail - head_->value_.load(std::memory_order_acquire) == capacity_)
+				return false;
+			records_[tail & (capacity_ - 1)] = record;
+			tail_->value_.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool TryPop(StateRecord& out_record)
+		{
+			const uint64_t head = head_->value_.load(std::memory_order_relaxed);
+			if (head == tail_->value_.load(std::memory_order_acquire))
+				return false;
+			out_record = records_[head & (capacity_ - 1)];
+			head_->value_.store(head + 1, std::memory_order_release);
+			return true;
+		}
+	};
+
+	/*
+	Barrier of the shard processes. Waiters spin for a while and then sleep on a futex of the shared mapping (not private,
+	the waiters are different processes). A failed shard aborts it, so the others don't wait forever.
+	*/
+	struct ProcessBarrier
+	{
+		static const constexpr unsigned int kSpinCount = 1024;
+
+		alignas(64) std::atomic<uint32_t> arrived_ = { 0 };
+		alignas(64) std::atomic<uint32_t> generation_ = { 0 };
+		std::atomic<uint32_t> num_sleeping_ = { 0 };
+		std::atomic<bool> aborted_ = { false };
+		static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the kernel waits on the plain word");
+
+		void Sleep(uint32_t generation)
+		{
+#ifdef __linux__
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&generation_), FUTEX_WAIT, generation, nullptr, nullptr, 0);
+#else
+			(void)generation;
+			std::this_thread::yield();
+#endif
+		}
+
+		// seq_cst pairs with the sleeper: either the waker sees num_sleeping_ or the sleeper sees the new generation
+		void WakeAll()
+		{
+#ifdef __linux__
+			if (num_sleeping_.load())
+			{
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&generation_), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+			}
+#endif
+		}
+
+		void Abort()
+		{
+			aborted_.store(true);
+			generation_.fetch_add(1);
+			WakeAll();
+		}
+
+		// false - the run was aborted
+		bool Wait(unsigned int num_processes)
+		{
+			const uint32_t generation = generation_.load(std::memory_order_acquire);
+			if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == num_processes)
+			{
+				arrived_.store(0, std::memory_order_relaxed);
+				generation_.fetch_add(1);
+				WakeAll();
+				return !aborted_.load(std::memory_order_relaxed);
+			}
+			// Spinning with more processes than hardware threads would only delay the ones still working
+			const unsigned int spin_count = (num_processes <= std::max(1u, std::thread::hardware_concurrency())) ? kSpinCount : 0;
+			for (unsigned int spin = 0; generation == generation_.load(std::memory_order_acquire); spin++)
+			{
+				if (aborted_.load(std::memory_order_relaxed))
+					return false;
+				if (spin < spin_count)
+				{
+					CpuRelax();
+					continue;
+				}
+				num_sleeping_.fetch_add(1);
+				if (generation == generation_.load())
+				{
+					Sleep(generation);
+				}
+				num_sleeping_.fetch_sub(1, std::memory_order_relaxed);
+			}
+			return !aborted_.load(std::memory_order_relaxed);
+		}
+	};
+
+	// Filled by the shard function, read by the parent after the run.
+	struct ShardResult
+	{
+		uint32_t num_objects_ = 0;
+		uint32_t num_exported_ = 0; // records sent per frame
+		uint32_t num_imported_ = 0; // records received per frame
+		uint32_t num_frames_ = 0;
+		double frame_us_ = 0.0; // median, scheduling and execution of the own objects
+		double exchange_us_ = 0.0; // median, ExchangeStates including the waits for the other shards
+		uint64_t checksum_ = 0; // free for the shard function, e.g. a checksum of the final state
+		bool finished_ = false;
+	};
+
+	struct ControlBlock
+	{
+		ProcessBarrier barrier_;
+		std::array<ShardResult, kMaxShards> results_;
+	};
+
+	class ShardedWorld;
+
+	// The view of one shard process.
+	class ShardContext
+	{
+		ShardedWorld& world_;
+		unsigned int shard_idx_;
+		vector<IThreadSafeObject*> local_objects_;
+
+	public:
+		ShardContext(ShardedWorld& world, unsigned int shard_idx);
+
+		unsigned int GetShardIndex() const { return shard_idx_; }
+		unsigned int GetNumShards() const;
+		const vector<IThreadSafeObject*>& GetLocalObjects() const { return local_objects_; }
+		ShardResult& GetResult();
+
+		/*
+		Sends the state of the own objects read by other shards and applies the states received from them. Every shard calls it
+		once per frame, after Execute. Returns false when the run was aborted.
+		*/
+		bool ExchangeStates();
+	};
+
+	/*
+	Partitions the objects and forks the shard processes. The clusters are assigned to shards largest first, to the least
+	loaded shard. The exchange lists and the rings are sized in the parent, so a frame never overflows a ring.
+	*/
+	class ShardedWorld
+	{
+		friend class ShardContext;
+
+		const vector<IThreadSafeObject*>& all_objects_;
+		unsigned int num_shards_ = 0;
+		vector<unsigned int> shard_of_object_;
+		vector<vector<uint32_t>> exports_; // [src * num_shards + dst] - objects of src read by objects of dst
+		vector<StateRing> rings_; // [src * num_shards + dst]
+		void* memory_ = nullptr;
+		size_t memory_size_ = 0;
+		ControlBlock* control_ = nullptr;
+
+		void Partition()
+		{
+			std::unique_ptr<SchedulerContext> context(new SchedulerContext());
+			const unsigned int num_clusters = Cluster::CreateClusters_Batched(all_objects_, context->clusters_, context->pool_);
+			vector<unsigned int> cluster_order(num_clusters);
+			for (unsigned int cluster_idx = 0; cluster_idx < num_clusters; cluster_idx++)
+			{
+				cluster_order[cluster_idx] = cluster_idx;
+			}
+			std::sort(cluster_order.begin(), cluster_order.end(), [&](unsigned int a, unsigned int b)
+			{
+				const unsigned int size_a = context->clusters_[a].GetObjects().size();
+				const unsigned int size_b = context->clusters_[b].GetObjects().size();
+				return (size_a != size_b) ? (size_a > size_b) : (a < b);
+			});
+			vector<unsigned int> shard_of_cluster(num_clusters, 0);
+			vector<size_t> shard_load(num_shards_, 0);
+			for (unsigned int cluster_idx : cluster_order)
+			{
+				const unsigned int shard_idx = static_cast<unsigned int>(std::min_element(shard_load.begin(), shard_load.end()) - shard_load.begin());
+				shard_of_cluster[cluster_idx] = shard_idx;
+				shard_load[shard_idx] += context->clusters_[cluster_idx].GetObjects().size();
+			}
+
+			shard_of_object_.resize(all_objects_.size());
+			for (size_t obj_idx = 0; obj_idx < all_objects_.size(); obj_idx++)
+			{
+				IThreadSafeObject* obj = all_objects_[obj_idx];
+				shard_of_object_[obj_idx] = shard_of_cluster[obj->GetClusterIndex()];
+				obj->SetClusterIndex(kNullIndex);
+			}
+			for (unsigned int cluster_idx = 0; cluster_idx < num_clusters; cluster_idx++)
+			{
+				context->clusters_[cluster_idx].Reset<false>();
+			}
+		}
+
+		void CollectExports()
+		{
+			std::unordered_map<const IThreadSafeObject*, uint32_t> index_of_object;
+			index_of_object.reserve(all_objects_.size());
+			for (size_t obj_idx = 0; obj_idx < all_objects_.size(); obj_idx++)
+			{
+				index_of_object.emplace(all_objects_[obj_idx], static_cast<uint32_t>(obj_idx));
+			}
+			exports_.assign(num_shards_ * num_shards_, {});
+			vector<const IThreadSafeObject*> const_dependencies;
+			for (size_t obj_idx = 0; obj_idx < all_objects_.size(); obj_idx++)
+			{
+				const unsigned int reader_shard = shard_of_object_[obj_idx];
+				const_dependencies.clear();
+				all_objects_[obj_idx]->GetConstDependencies(const_dependencies);
+				for (const IThreadSafeObject* dependency : const_dependencies)
+				{
+					auto found = index_of_object.find(dependency);
+					Assert(found != index_of_object.end());
+					const unsigned int owner_shard = shard_of_object_[found->second];
+					if (owner_shard != reader_shard)
+					{
+						exports_[owner_shard * num_shards_ + reader_shard].push_back(found->second);
+					}
+				}
+			}
+			for (auto& exported : exports_)
+			{
+				std::sort(exported.begin(), exported.end());
+				exported.erase(std::unique(exported.begin(), exported.end()), exported.end());
+			}
+		}
+
+		static uint32_t RingCapacity(size_t num_records)
+		{
+			uint32_t capacity = 1;
+			while (capacity < num_records)
+			{
+				capacity <<= 1;
+			}
+			return capacity;
+		}
+
+		bool MapSharedMemory()
+		{
+#ifdef __linux__
+			memory_size_ = sizeof(ControlBlock);
+			for (const auto& exported : exports_)
+			{
+				memory_size_ += StateRing::GetMemorySize(RingCapacity(exported.size()));
+			}
+			void* memory = mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (MAP_FAILED == memory)
+				return false;
+			memory_ = memory;
+			control_ = new (memory_) ControlBlock();
+			unsigned char* ring_memory = static_cast<unsigned char*>(memory_) + sizeof(ControlBlock);
+			rings_.resize(exports_.size());
+			for (size_t ring_idx = 0; ring_idx < exports_.size(); ring_idx++)
+			{
+				const uint32_t capacity = RingCapacity(exports_[ring_idx].size());
+				rings_[ring_idx].Bind(ring_memory, capacity);
+				ring_memory += StateRing::GetMemorySize(capacity);
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+	public:
+		ShardedWorld(const vector<IThreadSafeObject*>& all_objects, unsigned int num_shards)
+			: all_objects_(all_objects), num_shards_(std::min(std::max(num_shards, 1u), kMaxShards))
+		{
+			Partition();
+			CollectExports();
+		}
+
+		~ShardedWorld()
+		{
+#ifdef __linux__
+			if (memory_)
+			{
+				munmap(memory_, memory_size_);
+			}
+#endif
+		}
+
+		ShardedWorld(const ShardedWorld&) = delete;
+		ShardedWorld& operator=(const ShardedWorld&) = delete;
+
+		static bool IsSupported()
+		{
+#ifdef __linux__
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		unsigned int GetNumShards() const { return num_shards_; }
+		unsigned int GetShardOfObject(size_t obj_idx) const { return shard_of_object_[obj_idx]; }
+		size_t GetNumExported(unsigned int src_shard, unsigned int dst_shard) const { return exports_[src_shard * num_shards_ + dst_shard].size(); }
+		const ShardResult& GetResult(unsigned int shard_idx) const { Assert(control_ && shard_idx < num_shards_); return control_->results_[shard_idx]; }
+
+		/*
+		Forks a process per shard and runs shard_function(ShardContext&) in each of them, then waits for all of them.
+		The parallel backend and the group worker pool are reduced to the calling thread first, fork doesn't copy the workers. A shard sets its own
+		thread count. Returns false if a shard failed, the other shards are then released from their barriers.
+		*/
+		template<typename TFunction> bool Run(const TFunction& shard_function)
+		{
+#ifdef __linux__
+			if (!memory_ && !MapSharedMemory())
+				return false;
+			control_->~ControlBlock();
+			control_ = new (memory_) ControlBlock();
+			Parallel::SetNumThreads(1);
+			GroupWorkerPool::Get().SetNumThreads(1);
+
+			vector<pid_t> children;
+			for (unsigned int shard_idx = 0; shard_idx < num_shards_; shard_idx++)
+			{
+				const pid_t pid = fork();
+				if (0 == pid)
+				{
+					// The child never returns into the caller's code
+					try
+					{
+						ShardContext context(*this, shard_idx);
+						shard_function(context);
+						control_->results_[shard_idx].finished_ = !control_->barrier_.aborted_;
+					}
+					catch (...)
+					{
+						control_->barrier_.Abort();
+						_exit(1);
+					}
+					_exit(0);
+				}
+				if (pid < 0)
+				{
+					control_->barrier_.Abort();
+					break;
+				}
+				children.push_back(pid);
+			}
+
+			/*
+			Only the forked shards are reaped, other children of the process are left alone. They are polled, not waited for
+			one after another: a shard that crashed has to abort the barrier while the others still wait in it.
+			*/
+			bool succeeded = children.size() == num_shards_;
+			size_t num_running = children.size();
+			while (num_running)
+			{
+				bool reaped = false;
+				for (pid_t& pid : children)
+				{
+					if (0 == pid)
+						continue;
+					int status = 0;
+					const pid_t done = waitpid(pid, &status, WNOHANG);
+					if (0 == done || (done < 0 && EINTR == errno))
+						continue;
+					if (done < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+					{
+						control_->barrier_.Abort();
+						succeeded = false;
+					}
+					pid = 0;
+					num_running--;
+					reaped = true;
+				}
+				if (num_running && !reaped)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}
+			for (unsigned int shard_idx = 0; shard_idx < num_shards_; shard_idx++)
+			{
+				succeeded = succeeded && control_->results_[shard_idx].finished_;
+			}
+			return succeeded;
+#else
+			(void)shard_function;
+			return false;
+#endif
+		}
+	};
+
+	inline ShardContext::ShardContext(ShardedWorld& world, unsigned int shard_idx)
+		: world_(world), shard_idx_(shard_idx)
+	{
+		for (size_t obj_idx = 0; obj_idx < world_.all_objects_.size(); obj_idx++)
+		{
+			if (shard_idx_ == world_.shard_of_object_[obj_idx])
+			{
+				local_objects_.push_back(world_.all_objects_[obj_idx]);
+			}
+		}
+		ShardResult& result = GetResult();
+		result.num_objects_ = static_cast<uint32_t>(local_objects_.size());
+		for (unsigned int other_idx = 0; other_idx < world_.num_shards_; other_idx++)
+		{
+			result.num_exported_ += static_cast<uint32_t>(world_.GetNumExported(shard_idx_, other_idx));
+			result.num_imported_ += static_cast<uint32_t>(world_.GetNumExported(other_idx, shard_idx_));
+		}
+	}
+
+	inline unsigned int ShardContext::GetNumShards() const { return world_.num_shards_; }
+
+	inline ShardResult& ShardContext::GetResult() { return world_.control_->results_[shard_idx_]; }
+
+	inline bool ShardContext::ExchangeStates()
+	{
+		const unsigned int num_shards = world_.num_shards_;
+		StateRecord record;
+		for (unsigned int dst_idx = 0; dst_idx < num_shards; dst_idx++)
+		{
+			StateRing& ring = world_.rings_[shard_idx_ * num_shards + dst_idx];
+			for (uint32_t obj_idx : world_.exports_[shard_idx_ * num_shards + dst_idx])
+			{
+				record.object_idx_ = obj_idx;
+				record.size_ = world_.all_objects_[obj_idx]->WriteSharedState(record.data_);
+				Assert(record.size_ <= IThreadSafeObject::kMaxSharedStateSize);
+				const bool pushed = ring.TryPush(record);
+				Assert(pushed);
+				(void)pushed;
+			}
+		}
+		if (!world_.control_->barrier_.Wait(num_shards))
+			return false;
+		for (unsigned int src_idx = 0; src_idx < num_shards; src_idx++)
+		{
+			StateRing& ring = world_.rings_[src_idx * num_shards + shard_idx_];
+			while (ring.TryPop(record))
+			{
+				world_.all_objects_[record.object_idx_]->ReadSharedState(record.data_, record.size_);
+			}
+		}
+		// The next frame's records can't mix with this frame's
+		return world_.control_->barrier_.Wait(num_shards);
+	}
+}
+}
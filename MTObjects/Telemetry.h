@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#ifndef MTOBJECTS_TELEMETRY
+#define MTOBJECTS_TELEMETRY 1
+#endif
+
+#if MTOBJECTS_TELEMETRY
+#define IF_TELEMETRY(x) x
+#else
+#define IF_TELEMETRY(x)
+#endif //MTOBJECTS_TELEMETRY
+
+namespace MTObjects
+{
+	enum class EStat : unsigned char
+	{
+		ObjectsClustered,
+		ClustersCreated,
+		ClusterMerges,
+		ObjectsRelabeled,
+		ClusterDependencies,
+		GroupsCreated,
+		ClustersExecuted,
+		ObjectsExecuted,
+		ScheduleCacheHits,
+		ScheduleCacheMisses,
+		ClustersDeferred,
+		ObjectsDeferred,
+		DeadlineMisses,
+		ClustersYielded,
+		GroupsInlined,
+		ClusterBatches,
+		ObjectsSpawned,
+		ObjectsDestroyed,
+		Count
+	};
+
+	enum class EStatMax : unsigned char
+	{
+		ObjectsToHandle,
+		ObjectsToMerge,
+		ClustersInGroup,
+		Count
+	};
+
+	inline const char* ToString(EStat stat)
+	{
+		switch (stat)
+		{
+		case EStat::ObjectsClustered: return "objects_clustered";
+		case EStat::ClustersCreated: return "clusters_created";
+		case EStat::ClusterMerges: return "cluster_merges";
+		case EStat::ObjectsRelabeled: return "objects_relabeled";
+		case EStat::ClusterDependencies: return "cluster_dependencies";
+		case EStat::GroupsCreated: return "groups_created";
+		case EStat::ClustersExecuted: return "clusters_executed";
+		case EStat::ObjectsExecuted: return "objects_executed";
+		case EStat::ScheduleCacheHits: return "schedule_cache_hits";
+		case EStat::ScheduleCacheMisses: return "schedule_cache_misses";
+		case EStat::ClustersDeferred: return "clusters_deferred";
+		case EStat::ObjectsDeferred: return "objects_deferred";
+		case EStat::DeadlineMisses: return "deadline_misses";
+		case EStat::ClustersYielded: return "clusters_yielded";
+		case EStat::GroupsInlined: return "groups_inlined";
+		case EStat::ClusterBatches: return "cluster_batches";
+		case EStat::ObjectsSpawned: return "objects_spawned";
+		case EStat::ObjectsDestroyed: return "objects_destroyed";
+		default: return "unknown";
+		}
+	}
+
+	inline const char* ToString(EStatMax stat)
+	{
+		switch (stat)
+		{
+		case EStatMax::ObjectsToHandle: return "max_objects_to_handle";
+		case EStatMax::ObjectsToMerge: return "max_objects_to_merge";
+		case EStatMax::ClustersInGroup: return "max_clusters_in_group";
+		default: return "unknown";
+		}
+	}
+
+	struct FrameStats
+	{
+		std::array<uint64_t, static_cast<size_t>(EStat::Count)> counters_ = {};
+		std::array<uint64_t, static_cast<size_t>(EStatMax::Count)> maxima_ = {};
+
+		// Filled by the owner of the pool (FrameScheduler)
+		unsigned int chunks_in_use_ = 0;
+		unsigned int max_chunks_in_use_ = 0;
+		unsigned int chunks_capacity_ = 0;
+
+		uint64_t Get(EStat stat) const { return counters_[static_cast<size_t>(stat)]; }
+		uint64_t Get(EStatMax stat) const { return maxima_[static_cast<size_t>(stat)]; }
+
+		// The counters since an earlier Telemetry::Collect, the maxima are kept.
+		void SubtractCounters(const FrameStats& earlier)
+		{
+			for (size_t i = 0; i < counters_.size(); i++)
+			{
+				counters_[i] -= earlier.counters_[i];
+			}
+		}
+	};
+
+	/*
+	Always-on scheduler counters. Every thread writes only to its own cache line aligned slot (relaxed, no RMW),
+	the slots are summed up on demand. Hot loops accumulate locally and report once per cluster / phase.
+	The counters never go back, a FrameScheduler reports the difference between the start and the end of its frame.
+	Counters are process wide: frames of other worlds running at the same time are included in that difference.
+	The maxima are reported by the thread that runs the scheduling phases, every thread resets its own at the start of a frame.
+	The slot of a finished thread is handed to the next new thread with its counters, so the sums don't drop.
+	*/
+	class Telemetry
+	{
+		struct alignas(64) ThreadSlot
+		{
+			std::array<std::atomic<uint64_t>, static_cast<size_t>(EStat::Count)> counters_ = {};
+			std::array<std::atomic<uint64_t>, static_cast<size_t>(EStatMax::Count)> maxima_ = {};
+		};
+
+		struct Registry
+		{
+			std::mutex mutex_;
+			std::vector<std::unique_ptr<ThreadSlot>> slots_;
+			std::vector<ThreadSlot*> free_slots_;
+		};
+
+		// Never destroyed, workers of static pools exit after the static destructors.
+		static Registry& GetRegistry() { static Registry* registry = new Registry(); return *registry; }
+
+		static ThreadSlot* RegisterThread()
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			if (!registry.free_slots_.empty())
+			{
+				ThreadSlot* slot = registry.free_slots_.back();
+				registry.free_slots_.pop_back();
+				return slot;
+			}
+			registry.slots_.emplace_back(std::make_unique<ThreadSlot>());
+			return registry.slots_.back().get();
+		}
+
+		static void UnregisterThread(ThreadSlot* slot)
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			registry.free_slots_.push_back(slot);
+		}
+
+		struct SlotOwner
+		{
+			ThreadSlot* slot_ = RegisterThread();
+			~SlotOwner() { UnregisterThread(slot_); }
+		};
+
+		static ThreadSlot& Local()
+		{
+			thread_local SlotOwner owner;
+			return *owner.slot_;
+		}
+
+	public:
+		static void Add(EStat stat, uint64_t value)
+		{
+			auto& counter = Local().counters_[static_cast<size_t>(stat)];
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		static void Max(EStatMax stat, uint64_t value)
+		{
+			auto& maximum = Local().maxima_[static_cast<size_t>(stat)];
+			if (value > maximum.load(std::memory_order_relaxed))
+			{
+				maximum.store(value, std::memory_order_relaxed);
+			}
+		}
+
+		static FrameStats Collect()
+		{
+			FrameStats stats;
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			for (auto& slot : registry.slots_)
+			{
+				for (size_t i = 0; i < stats.counters_.size(); i++)
+				{
+					stats.counters_[i] += slot->counters_[i].load(std::memory_order_relaxed);
+				}
+				for (size_t i = 0; i < stats.maxima_.size(); i++)
+				{
+					stats.maxima_[i] = std::max<uint64_t>(stats.maxima_[i], slot->maxima_[i].load(std::memory_order_relaxed));
+				}
+			}
+			return stats;
+		}
+
+		// Only the calling thread writes its maxima, so the reset can't race with Max.
+		static void ResetThreadMaxima()
+		{
+			for (auto& maximum : Local().maxima_)
+			{
+				maximum.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		static void CollectThreadMaxima(FrameStats& stats)
+		{
+			const ThreadSlot& slot = Local();
+			for (size_t i = 0; i < stats.maxima_.size(); i++)
+			{
+				stats.maxima_[i] = slot.maxima_[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		// Slots in use and recycled ones.
+		static size_t GetNumSlots()
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			return registry.slots_.size();
+		}
+	};
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+#ifndef MTOBJECTS_TRACING
+#define MTOBJECTS_TRACING 1
+#endif
+
+#if MTOBJECTS_TRACING
+#define MTO_TRACE_CONCAT_INNER(a, b) a##b
+#define MTO_TRACE_CONCAT(a, b) MTO_TRACE_CONCAT_INNER(a, b)
+#define MTO_TRACE_SCOPE(name) ::MTObjects::TraceScope MTO_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define MTO_TRACE_SCOPE_ARG(name, arg_name, arg) ::MTObjects::TraceScope MTO_TRACE_CONCAT(trace_scope_, __LINE__)(name, arg_name, arg)
+#else
+#define MTO_TRACE_SCOPE(name)
+#define MTO_TRACE_SCOPE_ARG(name, arg_name, arg)
+#endif //MTOBJECTS_TRACING
+
+namespace MTObjects
+{
+	/*
+	Optional timeline recorder. Every thread writes begin/end events into its own ring buffer (single writer, no locks),
+	the oldest events are overwritten when the buffer is full. The result is written as Chrome Trace Event JSON
+	(chrome://tracing, Perfetto). Names must be string literals - only the pointers are stored.
+	Recording costs one relaxed load when disabled.
+	*/
+	class Tracer
+	{
+		friend struct TraceScope;
+	public:
+		static const constexpr uint32_t kEventsPerThread = 64 * 1024;
+
+		struct Event
+		{
+			const char* name_ = nullptr;
+			const char* arg_name_ = nullptr;
+			uint64_t timestamp_ns_ = 0;
+			int64_t arg_ = 0;
+			char phase_ = 0; // 'B' or 'E'
+		};
+
+	private:
+		struct ThreadBuffer
+		{
+			std::array<Event, kEventsPerThread> events_;
+			std::atomic<uint64_t> num_written_ = { 0 };
+			uint32_t thread_id_ = 0;
+		};
+
+		struct Registry
+		{
+			std::mutex mutex_;
+			std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+			std::atomic<bool> enabled_ = { false };
+			std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+		};
+
+		static Registry& GetRegistry() { static Registry registry; return registry; }
+
+		static ThreadBuffer* RegisterThread()
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			registry.buffers_.emplace_back(std::make_unique<ThreadBuffer>());
+			registry.buffers_.back()->thread_id_ = static_cast<uint32_t>(registry.buffers_.size());
+			return registry.buffers_.back().get();
+		}
+
+		static ThreadBuffer& Local()
+		{
+			// Registered on the first event, so threads that never trace don't get a buffer.
+			thread_local ThreadBuffer* buffer = RegisterThread();
+			return *buffer;
+		}
+
+		static void Record(char phase, const char* name, const char* arg_name, int64_t arg)
+		{
+			Registry& registry = GetRegistry();
+			ThreadBuffer& buffer = Local();
+			const uint64_t num_written = buffer.num_written_.load(std::memory_order_relaxed);
+			Event& event = buffer.events_[num_written % kEventsPerThread];
+			event.name_ = name;
+			event.arg_name_ = arg_name;
+			event.arg_ = arg;
+			event.phase_ = phase;
+			event.timestamp_ns_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry.epoch_).count());
+			buffer.num_written_.store(num_written + 1, std::memory_order_release);
+		}
+
+	public:
+		static void Enable(bool enable) { GetRegistry().enabled_.store(enable, std::memory_order_relaxed); }
+		static bool IsEnabled() { return GetRegistry().enabled_.load(std::memory_order_relaxed); }
+
+		static bool Begin(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+		{
+			const bool enabled = IsEnabled();
+			if (enabled)
+			{
+				Record('B', name, arg_name, arg);
+			}
+			return enabled;
+		}
+
+		static void End(const char* name)
+		{
+			if (IsEnabled())
+			{
+				Record('E', name, nullptr, 0);
+			}
+		}
+
+		// Drops all recorded events. Call it only when no thread records.
+		static void Clear()
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			for (auto& buffer : registry.buffers_)
+			{
+				buffer->num_written_.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		// Call it only when no thread records, otherwise the oldest events of a wrapped buffer can be torn.
+		static void WriteChromeTrace(std::ostream& out)
+		{
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex_);
+			out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+			bool first = true;
+			for (auto& buffer : registry.buffers_)
+			{
+				const uint64_t num_written = buffer->num_written_.load(std::memory_order_acquire);
+				if (0 == num_written)
+					continue;
+
+				out << (first ? "\n" : ",\n");
+				first = false;
+				out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id_
+					<< ",\"args\":{\"name\":\"thread " << buffer->thread_id_ << "\"}}";
+
+				const uint64_t first_event = (num_written > kEventsPerThread) ? (num_written - kEventsPerThread) : 0;
+				for (uint64_t event_idx = first_event; event_idx < num_written; event_idx++)
+				{
+					const Event& event = buffer->events_[event_idx % kEventsPerThread];
+					out << ",\n{\"name\":\"" << event.name_ << "\",\"ph\":\"" << event.phase_
+						<< "\",\"ts\":" << event.timestamp_ns_ / 1000 << "." << (event.timestamp_ns_ % 1000) / 100 << (event.timestamp_ns_ % 100) / 10 << event.timestamp_ns_ % 10
+						<< ",\"pid\":1,\"tid\":" << buffer->thread_id_;
+					if (event.arg_name_)
+					{
+						out << ",\"args\":{\"" << event.arg_name_ << "\":" << event.arg_ << "}";
+					}
+					out << "}";
+				}
+			}
+			out << "\n]}\n";
+		}
+	};
+
+	struct TraceScope
+	{
+		const char* name_;
+		bool recording_;
+
+		explicit TraceScope(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+			: name_(name)
+		{
+			recording_ = Tracer::Begin(name, arg_name, arg);
+		}
+
+		~TraceScope()
+		{
+			// Close the event even if tracing was disabled in the meantime
+			if (recording_)
+			{
+				Tracer::Record('E', name_, nullptr, 0);
+			}
+		}
+
+		TraceScope(const TraceScope&) = delete;
+		TraceScope& operator=(const TraceScope&) = delete;
+	};
+}
@@ -3,11 +3,20 @@
 #include <iterator>
 #include <array>
 #include <bitset>
-#include <intrin.h> 
 #include <algorithm>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstring>
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #ifndef TEST_STUFF
 //#define TEST_STUFF
@@ -21,6 +30,8 @@
 #define IF_TEST_STUFF(x)
 #endif //TEST_STUFF
 
+#include "Parallel.h"
+
 namespace MTObjects
 {
 	using std::vector;
@@ -28,25 +39,44 @@ namespace MTObjects
 	typedef unsigned short TChunkIndex;
 	static const constexpr TChunkIndex kNullIndex = 0xFFFF;
 
-#ifdef TEST_STUFF 
-	struct TestStuff
+	// Index of the lowest set bit. Returns false if mask is 0.
+	inline bool BitScanForward64(unsigned long& out_index, unsigned long long mask)
 	{
-		static unsigned int& max_num_objects_to_handle() { static unsigned int value = 0; return value; }
-		static unsigned int& max_num_data_chunks_used()  { static unsigned int value = 0; return value; }
-		static unsigned int& max_num_clusters() { static unsigned int value = 0; return value; }
-		static unsigned __int64& num_obj_cluster_overwritten() { static unsigned __int64 value = 0; return value; }
-		static unsigned int& max_objects_to_merge() { static unsigned int value = 0; return value; }
-
-		static void Reset()
-		{
-			max_num_objects_to_handle() = 0;
-			max_num_data_chunks_used() = 0;
-			max_num_clusters() = 0;
-			num_obj_cluster_overwritten() = 0;
-			max_objects_to_merge() = 0;
-		}
-	};
-#endif //TEST_STUFF
+#ifdef _MSC_VER
+		return 0 != _BitScanForward64(&out_index, mask);
+#else
+		if (0 == mask)
+			return false;
+		out_index = static_cast<unsigned long>(__builtin_ctzll(mask));
+		return true;
+#endif
+	}
+
+	// Hint that the cache line of address will be accessed soon.
+	inline void Prefetch(const void* address)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(_MSC_VER)
+		__prefetch(address);
+#else
+		__builtin_prefetch(address);
+#endif
+	}
+
+	// Spin-wait hint, lets the sibling hyper-thread run.
+	inline void CpuRelax()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(_MSC_VER)
+		__yield();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield");
+#endif
+	}
 
 	namespace SmartStackStuff
 	{
@@ -72,19 +102,133 @@ namespace MTObjects
 			}
 		};
 		static_assert(sizeof(DataChunk) == kDataChunkSize);
+		static_assert(std::is_trivially_destructible<DataChunk>::value, "ChunkStorage doesn't destroy the chunks");
+
+		enum class EPageBacking : unsigned char
+		{
+			Default,				// no advice, regular pages unless the system uses THP for everything
+			TransparentHugePages,	// madvise(MADV_HUGEPAGE), falls back to Default
+			HugePages,				// mmap(MAP_HUGETLB) from the reserved huge page pool, falls back to TransparentHugePages
+		};
+
+		inline const char* ToString(EPageBacking backing)
+		{
+			switch (backing)
+			{
+			case EPageBacking::TransparentHugePages: return "TransparentHugePages";
+			case EPageBacking::HugePages: return "HugePages";
+			default: return "Default";
+			}
+		}
+
+		/*
+		Backing store for the chunks. Huge pages reduce TLB misses of the random GetChunk access pattern.
+		Only Linux supports huge pages here, everywhere else (or when the system refuses) the memory comes from the regular heap.
+		*/
+		struct PageBackedMemory
+		{
+			static const constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+		private:
+			void* memory_ = nullptr;
+			size_t size_ = 0;
+			void* mapping_ = nullptr;
+			size_t mapping_size_ = 0;
+			EPageBacking backing_ = EPageBacking::Default;
+
+		public:
+			PageBackedMemory(size_t size, EPageBacking requested_backing)
+			{
+				size_ = size;
+#ifdef __linux__
+				const size_t huge_size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+				if (EPageBacking::HugePages == requested_backing)
+				{
+					void* ptr = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+					if (MAP_FAILED != ptr)
+					{
+						memory_ = mapping_ = ptr;
+						mapping_size_ = huge_size;
+						backing_ = EPageBacking::HugePages;
+						return;
+					}
+					requested_backing = EPageBacking::TransparentHugePages;
+				}
+
+				// Over-allocate, so the used range can be aligned to the huge page size. THP can back only aligned ranges.
+				const size_t map_size = huge_size + kHugePageSize;
+				void* ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (MAP_FAILED != ptr)
+				{
+					mapping_ = ptr;
+					mapping_size_ = map_size;
+					const auto aligned = (reinterpret_cast<uintptr_t>(ptr) + kHugePageSize - 1) & ~(kHugePageSize - 1);
+					memory_ = reinterpret_cast<void*>(aligned);
+					// Default is left unadvised, the system-wide THP policy applies as to any other allocation.
+					const bool advised = (EPageBacking::TransparentHugePages == requested_backing) && (0 == madvise(memory_, huge_size, MADV_HUGEPAGE));
+					backing_ = advised ? EPageBacking::TransparentHugePages : EPageBacking::Default;
+					return;
+				}
+#endif //__linux__
+				(void)requested_backing;
+				memory_ = ::operator new(size, std::align_val_t(kDataChunkSize));
+				backing_ = EPageBacking::Default;
+			}
+
+			~PageBackedMemory()
+			{
+#ifdef __linux__
+				if (mapping_)
+				{
+					munmap(mapping_, mapping_size_);
+					return;
+				}
+#endif //__linux__
+				::operator delete(memory_, std::align_val_t(kDataChunkSize));
+			}
+
+			PageBackedMemory(const PageBackedMemory&) = delete;
+			PageBackedMemory& operator=(const PageBackedMemory&) = delete;
+
+			void* GetMemory() const { return memory_; }
+			size_t GetSize() const { return size_; }
+			EPageBacking GetBacking() const { return backing_; }
+		};
+
+		template<int kNumberChunks> struct ChunkStorage
+		{
+		private:
+			PageBackedMemory memory_;
+			DataChunk* chunks_ = nullptr;
+
+		public:
+			explicit ChunkStorage(EPageBacking backing)
+				: memory_(sizeof(DataChunk) * kNumberChunks, backing)
+			{
+				chunks_ = static_cast<DataChunk*>(memory_.GetMemory());
+				for (int i = 0; i < kNumberChunks; i++)
+				{
+					new (&chunks_[i]) DataChunk();
+				}
+			}
+
+			DataChunk& operator[](size_t index) { return chunks_[index]; }
+			const DataChunk& operator[](size_t index) const { return chunks_[index]; }
+			EPageBacking GetBacking() const { return memory_.GetBacking(); }
+		};
 
 		struct DataChunkMemoryPool64_Experimental
 		{
 			static const constexpr int kNumberChunks = 64 * 1024 - 2;
 
 		private:
-			std::array<DataChunk, kNumberChunks> chunks_;
-			concurrency::concurrent_queue<TChunkIndex> unallocated_chunks;
-			IF_TEST_STUFF(unsigned int num_chunks_allocated = 0);
+			ChunkStorage<kNumberChunks> chunks_;
+			Parallel::ConcurrentQueue<TChunkIndex> unallocated_chunks;
+			std::atomic<unsigned int> num_chunks_allocated_ = { 0 };
+			std::atomic<unsigned int> max_num_chunks_allocated_ = { 0 };
 		public:
-			static DataChunkMemoryPool64_Experimental instance;
-
-			DataChunkMemoryPool64_Experimental()
+			explicit DataChunkMemoryPool64_Experimental(EPageBacking backing = EPageBacking::Default)
+				: chunks_(backing)
 			{
 				for (TChunkIndex i = 0; i < kNumberChunks; i++)
 				{
@@ -97,7 +241,7 @@ namespace MTObjects
 
 			bool AllFree() const
 			{
-				IF_TEST_STUFF(Assert(kNumberChunks - unallocated_chunks.unsafe_size() == num_chunks_allocated));
+				Assert(kNumberChunks - unallocated_chunks.unsafe_size() == num_chunks_allocated_);
 				return unallocated_chunks.unsafe_size() == kNumberChunks;
 			}
 
@@ -106,15 +250,28 @@ namespace MTObjects
 				TChunkIndex index = kNullIndex;
 				const bool ok = unallocated_chunks.try_pop(index);
 				Assert(ok);
-				IF_TEST_STUFF(num_chunks_allocated++);
-				IF_TEST_STUFF(TestStuff::max_num_data_chunks_used() = std::max<unsigned int>(TestStuff::max_num_data_chunks_used(), num_chunks_allocated));
+				const unsigned int num_chunks_allocated = ++num_chunks_allocated_;
+				for (unsigned int max_num = max_num_chunks_allocated_; max_num < num_chunks_allocated && !max_num_chunks_allocated_.compare_exchange_weak(max_num, num_chunks_allocated);) {}
 				return index;
 			}
 
 			template<bool kThreadSafe> void Release(TChunkIndex index)
 			{
 				unallocated_chunks.push(index);
-				IF_TEST_STUFF(num_chunks_allocated--);
+				num_chunks_allocated_--;
+			}
+
+			// The queue can't hand out a given chunk, the hint is ignored.
+			template<bool kThreadSafe> TChunkIndex AllocateAfter(TChunkIndex previous)
+			{
+				(void)previous;
+				return Allocate<kThreadSafe>();
+			}
+
+			TChunkIndex FindFreeRun(unsigned int num_chunks) const
+			{
+				(void)num_chunks;
+				return kNullIndex;
 			}
 
 			DataChunk* GetChunk(TChunkIndex index)
@@ -126,12 +283,22 @@ namespace MTObjects
 			{
 				return static_cast<TChunkIndex>(std::distance(&chunks_[0], chunk));
 			}
+
+			EPageBacking GetBacking() const
+			{
+				return chunks_.GetBacking();
+			}
+
+			static const char* GetName() { return "DataChunkMemoryPool64_Experimental"; }
+			unsigned int GetNumChunksAllocated() const { return num_chunks_allocated_; }
+			unsigned int GetMaxNumChunksAllocated() const { return max_num_chunks_allocated_; }
+			void ResetMaxNumChunksAllocated() { max_num_chunks_allocated_ = num_chunks_allocated_.load(); }
 		};
 
 		struct DataChunkMemoryPool64
 		{
 			static const constexpr int kBitsetSize = 64; //size of range
-			static const constexpr int kBitsetsInFirstLevel = 1;
+			static const constexpr int kBitsetsInFirstLevel = 4;
 			static const constexpr int kRangeNum = kBitsetSize * kBitsetsInFirstLevel;
 			static const constexpr int kNumberChunks = kBitsetSize * kRangeNum;
 
@@ -139,7 +306,7 @@ namespace MTObjects
 			{
 				static bool FirstZeroInBitset(const std::bitset<kBitsetSize>& bitset, unsigned long& out_index)
 				{
-					return 0 != _BitScanForward64(&out_index, ~bitset.to_ullong());
+					return BitScanForward64(out_index, ~bitset.to_ullong());
 				}
 
 				std::array<std::bitset<kBitsetSize>, kBitsetsInFirstLevel> bitsets_;
@@ -172,15 +339,16 @@ namespace MTObjects
 			};
 
 		private:
-			std::array<DataChunk, kNumberChunks> chunks_;
+			ChunkStorage<kNumberChunks> chunks_;
 			std::array<std::bitset<kBitsetSize>, kRangeNum> is_element_occupied_;
 			ExtendedBitset is_range_fully_occupied_;
-			IF_TEST_STUFF(unsigned int num_chunks_allocated = 0);
+			unsigned int num_chunks_allocated_ = 0;
+			unsigned int max_num_chunks_allocated_ = 0;
 			std::mutex mutex_;
 		public:
-			static DataChunkMemoryPool64 instance;
-
-			DataChunkMemoryPool64() = default;
+			explicit DataChunkMemoryPool64(EPageBacking backing = EPageBacking::Default)
+				: chunks_(backing)
+			{}
 			~DataChunkMemoryPool64() = default;
 			DataChunkMemoryPool64(DataChunkMemoryPool64&) = delete;
 			DataChunkMemoryPool64& operator=(DataChunkMemoryPool64&) = delete;
@@ -192,7 +360,7 @@ namespace MTObjects
 					if (bs.any())
 						return false;
 				}
-				IF_TEST_STUFF(Assert(0 == num_chunks_allocated));
+				Assert(0 == num_chunks_allocated_);
 				return true;
 			}
 
@@ -204,30 +372,61 @@ namespace MTObjects
 				return static_cast<TChunkIndex>(result);
 			}
 
-			template<bool kThreadSafe> TChunkIndex Allocate()
+		private:
+			TChunkIndex Occupy(unsigned int range, unsigned int bit_idx)
 			{
-				auto implementation = [&]()
-				{
-					IF_TEST_STUFF(Assert(num_chunks_allocated < kNumberChunks));
+				auto& range_bitset = is_element_occupied_[range];
+				Assert(!range_bitset[bit_idx]);
+				range_bitset[bit_idx] = true;
 
-					const auto first_range_with_free_space = is_range_fully_occupied_.FirstZeroIndex();
-					Assert(first_range_with_free_space < kRangeNum);
-					auto& range_bitset = is_element_occupied_[first_range_with_free_space];
+				is_range_fully_occupied_.Set(range, range_bitset.all());
 
-					Assert(!range_bitset.all());
-					const auto bit_idx = FirstZeroInBitset(range_bitset);
+				num_chunks_allocated_++;
+				max_num_chunks_allocated_ = std::max(max_num_chunks_allocated_, num_chunks_allocated_);
 
-					Assert(!range_bitset[bit_idx]);
-					range_bitset[bit_idx] = true;
+				auto chunk_index = range * kBitsetSize + bit_idx;
+				Assert(chunk_index != kNullIndex);
+				return static_cast<TChunkIndex>(chunk_index);
+			}
 
-					is_range_fully_occupied_.Set(first_range_with_free_space, range_bitset.all());
+			TChunkIndex AllocateFirstFree()
+			{
+				Assert(num_chunks_allocated_ < kNumberChunks);
+
+				const auto first_range_with_free_space = is_range_fully_occupied_.FirstZeroIndex();
+				Assert(first_range_with_free_space < kRangeNum);
+				auto& range_bitset = is_element_occupied_[first_range_with_free_space];
 
-					IF_TEST_STUFF(num_chunks_allocated++);
-					IF_TEST_STUFF(TestStuff::max_num_data_chunks_used() = std::max<unsigned int>(TestStuff::max_num_data_chunks_used(), num_chunks_allocated));
+				Assert(!range_bitset.all());
+				return Occupy(first_range_with_free_space, FirstZeroInBitset(range_bitset));
+			}
 
-					auto chunk_index = first_range_with_free_space * kBitsetSize + bit_idx;
-					Assert(chunk_index != kNullIndex);
-					return static_cast<TChunkIndex>(chunk_index);
+		public:
+			template<bool kThreadSafe> TChunkIndex Allocate()
+			{
+				if constexpr(kThreadSafe)
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					return AllocateFirstFree();
+				}
+				else
+				{
+					return AllocateFirstFree();
+				}
+			}
+
+			/*
+			The chunk right after previous when it is free, otherwise the same as Allocate. previous may be kNullIndex, then chunk 0 is wanted.
+			Only for callers that opt in (SmartStack::Compact), SmartStack grows with Allocate.
+			*/
+			template<bool kThreadSafe> TChunkIndex AllocateAfter(TChunkIndex previous)
+			{
+				auto implementation = [&]()
+				{
+					const unsigned int index = static_cast<TChunkIndex>(previous + 1);
+					if (index >= kNumberChunks || is_element_occupied_[index / kBitsetSize][index % kBitsetSize])
+						return AllocateFirstFree();
+					return Occupy(index / kBitsetSize, index % kBitsetSize);
 				};
 
 				if constexpr(kThreadSafe)
@@ -241,6 +440,34 @@ namespace MTObjects
 				}
 			}
 
+			// First chunk of num_chunks consecutive free chunks, kNullIndex if there is no such run. Not synchronized.
+			TChunkIndex FindFreeRun(unsigned int num_chunks) const
+			{
+				unsigned int run_start = 0;
+				unsigned int run_length = 0;
+				for (unsigned int range = 0; range < kRangeNum && run_length < num_chunks; range++)
+				{
+					const std::bitset<kBitsetSize>& range_bitset = is_element_occupied_[range];
+					if (range_bitset.none())
+					{
+						run_start = run_length ? run_start : range * kBitsetSize;
+						run_length += kBitsetSize;
+						continue;
+					}
+					for (unsigned int bit_idx = 0; bit_idx < kBitsetSize && run_length < num_chunks; bit_idx++)
+					{
+						if (range_bitset[bit_idx])
+						{
+							run_length = 0;
+							continue;
+						}
+						run_start = run_length ? run_start : range * kBitsetSize + bit_idx;
+						run_length++;
+					}
+				}
+				return (num_chunks && run_length >= num_chunks) ? static_cast<TChunkIndex>(run_start) : kNullIndex;
+			}
+
 			template<bool kThreadSafe> void Release(TChunkIndex index)
 			{
 				auto implementation = [&]()
@@ -255,7 +482,7 @@ namespace MTObjects
 					range_bitset[bit_idx] = false;
 
 					is_range_fully_occupied_.Set(range, false);
-					IF_TEST_STUFF(num_chunks_allocated--);
+					num_chunks_allocated_--;
 				};
 
 				if constexpr(kThreadSafe)
@@ -279,13 +506,32 @@ namespace MTObjects
 				return static_cast<TChunkIndex>(std::distance(&chunks_[0], chunk));
 			}
 
+			EPageBacking GetBacking() const
+			{
+				return chunks_.GetBacking();
+			}
+
+			static const char* GetName() { return "DataChunkMemoryPool64"; }
+
+			// Not synchronized, read them when no thread uses the pool.
+			unsigned int GetNumChunksAllocated() const { return num_chunks_allocated_; }
+			unsigned int GetMaxNumChunksAllocated() const { return max_num_chunks_allocated_; }
+			void ResetMaxNumChunksAllocated() { max_num_chunks_allocated_ = num_chunks_allocated_; }
 		};
 	};
 
+	// Each world (SchedulerContext) owns its pool, there is no global instance.
+#ifdef MTOBJECTS_EXPERIMENTAL_POOL
+	using ChunkMemoryPool = SmartStackStuff::DataChunkMemoryPool64_Experimental;
+#else
+	using ChunkMemoryPool = SmartStackStuff::DataChunkMemoryPool64;
+#endif
+
 	/*
 	SmartStack is optimized for:
 	- push_back, back, pop_back
 	- unordered merge
+	All chunks of a SmartStack come from the pool it is bound to. Stacks can be merged only within the same pool.
 	*/
 	template<typename T>
 	struct SmartStack
@@ -299,19 +545,24 @@ namespace MTObjects
 		unsigned short number_of_elements_in_last_chunk_ = kElementsPerChunk;
 
 	private:
-		static SmartStackStuff::DataChunk* GetPtr(TChunkIndex index)
+		ChunkMemoryPool* pool_ = nullptr;
+
+		SmartStackStuff::DataChunk* GetPtr(TChunkIndex index) const
 		{
-			return (kNullIndex != index) ? SmartStackStuff::DataChunkMemoryPool64::instance.GetChunk(index) : nullptr;
+			Assert(kNullIndex == index || pool_);
+			return (kNullIndex != index) ? pool_->GetChunk(index) : nullptr;
 		}
 
-		static TChunkIndex GetIndex(SmartStackStuff::DataChunk* chunk)
+		TChunkIndex GetIndex(SmartStackStuff::DataChunk* chunk) const
 		{
-			return (nullptr != chunk) ? SmartStackStuff::DataChunkMemoryPool64::instance.GetIndex(chunk) : kNullIndex;
+			Assert(nullptr == chunk || pool_);
+			return (nullptr != chunk) ? pool_->GetIndex(chunk) : kNullIndex;
 		}
 
 		template<bool kThreadSafe> void AllocateNextChunk()
 		{
-			auto new_chunk = SmartStackStuff::DataChunkMemoryPool64::instance.Allocate<kThreadSafe>();
+			Assert(pool_);
+			auto new_chunk = pool_->Allocate<kThreadSafe>();
 			Assert(new_chunk != kNullIndex);
 			auto new_chunk_ptr = GetPtr(new_chunk);
 			new_chunk_ptr->Clear();
@@ -343,7 +594,7 @@ namespace MTObjects
 			number_chunks_--;
 			Assert(0 == number_of_elements_in_last_chunk_);
 			number_of_elements_in_last_chunk_ = kElementsPerChunk;
-			SmartStackStuff::DataChunkMemoryPool64::instance.Release<kThreadSafe>(chunk_to_release);
+			pool_->Release<kThreadSafe>(chunk_to_release);
 
 			last_chunk_ = GetIndex(GetPtr(chunk_to_release)->previous_chunk_);
 			if (kNullIndex != last_chunk_)
@@ -361,7 +612,7 @@ namespace MTObjects
 		T* ElementsInLastChunk() const
 		{
 			Assert(kNullIndex != last_chunk_);
-			return reinterpret_cast<T*>(SmartStackStuff::DataChunkMemoryPool64::instance.GetChunk(last_chunk_)->GetMemory());
+			return reinterpret_cast<T*>(pool_->GetChunk(last_chunk_)->GetMemory());
 		}
 	public:
 		unsigned int size() const
@@ -374,6 +625,18 @@ namespace MTObjects
 			return 0 == size();
 		}
 
+		ChunkMemoryPool& GetPool() const
+		{
+			Assert(pool_);
+			return *pool_;
+		}
+
+		void SetPool(ChunkMemoryPool& pool)
+		{
+			Assert(empty() || pool_ == &pool);
+			pool_ = &pool;
+		}
+
 		T& back()
 		{
 			return ElementsInLastChunk()[number_of_elements_in_last_chunk_ - 1];
@@ -418,7 +681,7 @@ namespace MTObjects
 					auto temo_ptr = chunk_ptr;
 					chunk_ptr = chunk_ptr->next_chunk_;
 					Assert(nullptr == chunk_ptr || (chunk_ptr->previous_chunk_ == temo_ptr));
-					SmartStackStuff::DataChunkMemoryPool64::instance.Release<kThreadSafe>(GetIndex(temo_ptr));
+					pool_->Release<kThreadSafe>(GetIndex(temo_ptr));
 					IF_TEST_STUFF(released_chunks++);
 				}
 				IF_TEST_STUFF(Assert(number_chunks_ == released_chunks));
@@ -441,8 +704,13 @@ namespace MTObjects
 		}
 
 	public:
-		struct Iter : public std::iterator<std::bidirectional_iterator_tag, T>
+		struct Iter
 		{
+			using iterator_category = std::bidirectional_iterator_tag;
+			using value_type = T;
+			using difference_type = std::ptrdiff_t;
+			using pointer = T*;
+			using reference = T&;
 		private:
 			SmartStackStuff::DataChunk* chunk_ = nullptr;
 			int element_index_ = 0;
@@ -560,8 +828,78 @@ namespace MTObjects
 			return Iter(GetPtr(last_chunk_), number_of_elements_in_last_chunk_);
 		}
 
+		// Number of links to a chunk that is not the next one in the pool, 0 - the chain is one consecutive run.
+		unsigned int CountChunkBreaks() const
+		{
+			unsigned int num_breaks = 0;
+			for (auto chunk_ptr = GetPtr(first_chunk_); chunk_ptr && chunk_ptr->next_chunk_; chunk_ptr = chunk_ptr->next_chunk_)
+			{
+				num_breaks += (chunk_ptr->next_chunk_ != chunk_ptr + 1) ? 1 : 0;
+			}
+			return num_breaks;
+		}
+
+		/*
+		Moves the elements onto a run of consecutive free chunks, so walking the chain becomes a linear scan of the pool.
+		Meant for containers kept across frames, whose chains were scattered by merges. Returns the number of moved chunks,
+		0 when the chain is already consecutive or the pool has no free run long enough. Not thread safe, no other thread may use the pool.
+		*/
+		unsigned int Compact()
+		{
+			static_assert(std::is_trivially_copyable<T>::value);
+			if (number_chunks_ < 2 || 0 == CountChunkBreaks())
+				return 0;
+			const TChunkIndex run_start = pool_->FindFreeRun(number_chunks_);
+			if (kNullIndex == run_start)
+				return 0;
+
+			TChunkIndex previous = static_cast<TChunkIndex>(run_start - 1);
+			SmartStackStuff::DataChunk* previous_ptr = nullptr;
+			for (SmartStackStuff::DataChunk* old_chunk = GetPtr(first_chunk_); old_chunk;)
+			{
+				const TChunkIndex new_index = pool_->AllocateAfter<false>(previous);
+				SmartStackStuff::DataChunk* new_chunk = GetPtr(new_index);
+				new_chunk->Clear();
+				std::memcpy(new_chunk->GetMemory(), old_chunk->GetMemory(), SmartStackStuff::DataChunk::kStoragePerChunk);
+				new_chunk->previous_chunk_ = previous_ptr;
+				if (previous_ptr)
+				{
+					previous_ptr->next_chunk_ = new_chunk;
+				}
+				else
+				{
+					first_chunk_ = new_index;
+				}
+				SmartStackStuff::DataChunk* const next_old_chunk = old_chunk->next_chunk_;
+				pool_->Release<false>(GetIndex(old_chunk));
+				old_chunk = next_old_chunk;
+				previous = new_index;
+				previous_ptr = new_chunk;
+			}
+			last_chunk_ = previous;
+			IF_TEST_STUFF(ValidateNumberOfChunks());
+			return number_chunks_;
+		}
+
+		// Calls function(begin, end) for consecutive runs of whole chunks, about elements_per_slice elements each (at least one chunk).
+		template<typename TFunction> void ForEachSlice(unsigned int elements_per_slice, const TFunction& function) const
+		{
+			const unsigned int chunks_per_slice = std::max(1u, elements_per_slice / kElementsPerChunk);
+			SmartStackStuff::DataChunk* chunk = GetPtr(first_chunk_);
+			while (chunk)
+			{
+				SmartStackStuff::DataChunk* const slice_first_chunk = chunk;
+				for (unsigned int chunk_idx = 0; chunk_idx < chunks_per_slice && chunk; chunk_idx++)
+				{
+					chunk = chunk->next_chunk_;
+				}
+				function(Iter(slice_first_chunk, 0), chunk ? Iter(chunk, 0) : end());
+			}
+		}
+
 	public:
 		SmartStack() = default;
+		explicit SmartStack(ChunkMemoryPool& pool) : pool_(&pool) {}
 		~SmartStack()
 		{
 			clear<false>();
@@ -573,6 +911,7 @@ namespace MTObjects
 			last_chunk_ = other.last_chunk_;
 			number_chunks_ = other.number_chunks_;
 			number_of_elements_in_last_chunk_ = other.number_of_elements_in_last_chunk_;
+			pool_ = other.pool_;
 
 			other.first_chunk_ = kNullIndex;
 			other.last_chunk_ = kNullIndex;
@@ -584,12 +923,13 @@ namespace MTObjects
 		{
 			if (this != &other)
 			{
-				clear();
+				clear<false>();
 
 				first_chunk_ = other.first_chunk_;
 				last_chunk_ = other.last_chunk_;
 				number_chunks_ = other.number_chunks_;
 				number_of_elements_in_last_chunk_ = other.number_of_elements_in_last_chunk_;
+				pool_ = other.pool_;
 
 				other.first_chunk_ = kNullIndex;
 				other.last_chunk_ = kNullIndex;
@@ -615,6 +955,7 @@ namespace MTObjects
 			IF_TEST_STUFF(dst.ValidateNumberOfChunks());
 
 			if (src.empty()) { return; }
+			Assert(dst.pool_ == src.pool_);
 			if (dst.empty())
 			{
 				Assert(kNullIndex == dst.first_chunk_ && 0 == dst.number_chunks_);
@@ -666,16 +1007,16 @@ namespace MTObjects
 				Assert(dst.number_of_elements_in_last_chunk_ == kElementsPerChunk || src.number_of_elements_in_last_chunk_ == kElementsPerChunk);
 				if (dst.number_of_elements_in_last_chunk_ == kElementsPerChunk)
 				{	//src goes last
-					GetPtr(dst.last_chunk_)->next_chunk_ = GetPtr(src.first_chunk_);
-					GetPtr(src.first_chunk_)->previous_chunk_ = GetPtr(dst.last_chunk_);
+					dst.GetPtr(dst.last_chunk_)->next_chunk_ = src.GetPtr(src.first_chunk_);
+					src.GetPtr(src.first_chunk_)->previous_chunk_ = dst.GetPtr(dst.last_chunk_);
 					dst.last_chunk_ = src.last_chunk_;
 
 					dst.number_of_elements_in_last_chunk_ = src.number_of_elements_in_last_chunk_;
 				}
 				else
 				{	//src goes first
-					GetPtr(src.last_chunk_)->next_chunk_ = GetPtr(dst.first_chunk_);
-					GetPtr(dst.first_chunk_)->previous_chunk_ = GetPtr(src.last_chunk_);
+					src.GetPtr(src.last_chunk_)->next_chunk_ = dst.GetPtr(dst.first_chunk_);
+					dst.GetPtr(dst.first_chunk_)->previous_chunk_ = src.GetPtr(src.last_chunk_);
 					dst.first_chunk_ = src.first_chunk_;
 				}
 				dst.number_chunks_ += src.number_chunks_;
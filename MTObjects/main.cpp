@@ -1,282 +1,906 @@
-#include "IThreadSafeObject.h"
+#include "Benchmark.h"
+#include "GraphCapture.h"
+#include "PerfCounters.h"
 #include <vector>
 #include <algorithm>
 #include <random>
 #include <iostream>
 #include <chrono>
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
 
 using namespace MTObjects;
 using std::vector;
 
-SmartStackStuff::DataChunkMemoryPool64 SmartStackStuff::DataChunkMemoryPool64::instance;
-
-class TestObject : public IThreadSafeObject
+/*
+Counts the global heap allocations of the process while enabled, so the diagnostics can prove the scheduler doesn't allocate.
+Only --diagnostics enables it, the other runs pay just the relaxed load of the flag.
+*/
+struct AllocationCounter
 {
-public:
-	vector<TestObject*> dependencies_;
-	vector<const TestObject*> const_dependencies_;
+	static std::atomic<bool>& Enabled() { static std::atomic<bool> value = { false }; return value; }
+	static std::atomic<unsigned long long>& Counter() { static std::atomic<unsigned long long> value = { 0 }; return value; }
+	static void Enable(bool enable) { Enabled().store(enable, std::memory_order_relaxed); }
+	static unsigned long long Get() { return Counter().load(std::memory_order_relaxed); }
 
-	int id_ = -1;
+	static void Count()
+	{
+		if (Enabled().load(std::memory_order_relaxed))
+		{
+			Counter().fetch_add(1, std::memory_order_relaxed);
+		}
+	}
 
-	void IsDependentOn(FastContainer<IThreadSafeObject*>& ref_dependencies) const override
+	// The replaced operators stay out of line, inlined into a new expression GCC would report free() as mismatched.
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	static void* Allocate(size_t size)
 	{
-		ref_dependencies.Insert(*(vector<IThreadSafeObject*>*)&dependencies_);
+		Count();
+		if (void* ptr = std::malloc(size ? size : 1))
+			return ptr;
+		throw std::bad_alloc();
 	}
 
-	void IsConstDependentOn(IndexSet& ref_dependencies) const override
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	static void* AllocateAligned(size_t size, std::align_val_t alignment)
 	{
-		for (auto obj : const_dependencies_)
+		Count();
+		size = size ? size : 1;
+#ifdef _WIN32
+		void* ptr = _aligned_malloc(size, static_cast<size_t>(alignment));
+#else
+		void* ptr = nullptr;
+		if (0 != posix_memalign(&ptr, std::max(static_cast<size_t>(alignment), sizeof(void*)), size))
 		{
-			ref_dependencies[obj->GetClusterIndex()] = true;
+			ptr = nullptr;
 		}
+#endif
+		if (ptr)
+			return ptr;
+		throw std::bad_alloc();
+	}
+
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	static void Free(void* ptr) noexcept
+	{
+		std::free(ptr);
 	}
 
-	void Task() override
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	static void FreeAligned(void* ptr) noexcept
 	{
+#ifdef _WIN32
+		_aligned_free(ptr);
+#else
+		std::free(ptr);
+#endif
 	}
 };
 
-static vector<TestObject*> GenerateObjects(int num_objects, int forced_clusters_num, int dependencies_num, int const_dependencies_num, std::default_random_engine& generator)
+void* operator new(size_t size) { return AllocationCounter::Allocate(size); }
+void* operator new[](size_t size) { return AllocationCounter::Allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return AllocationCounter::AllocateAligned(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return AllocationCounter::AllocateAligned(size, alignment); }
+void operator delete(void* ptr) noexcept { AllocationCounter::Free(ptr); }
+void operator delete[](void* ptr) noexcept { AllocationCounter::Free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { AllocationCounter::Free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { AllocationCounter::Free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { AllocationCounter::FreeAligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { AllocationCounter::FreeAligned(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { AllocationCounter::FreeAligned(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { AllocationCounter::FreeAligned(ptr); }
+
+// Compares clustering time and dTLB misses between 4K and huge page backing of the chunk pool.
+static void BenchmarkPageBacking(const vector<IThreadSafeObject*>& all_objects, int repeat)
 {
-	std::cout << "Generating objects..." << std::endl;
+	using SmartStackStuff::EPageBacking;
+	std::clog << std::endl << "Page backing benchmark:" << std::endl;
+	for (auto requested_backing : { EPageBacking::Default, EPageBacking::TransparentHugePages, EPageBacking::HugePages })
+	{
+		auto context = std::make_unique<SchedulerContext>(requested_backing);
+		PerfCounter dtlb_misses(EPerfEvent::DTLBLoadMisses);
+		long long all_time_us = 0;
+		uint64_t all_dtlb_misses = 0;
+		for (int i = 0; i < repeat; i++)
+		{
+			std::chrono::system_clock::time_point time_0 = std::chrono::system_clock::now();
+			dtlb_misses.Start();
 
-	vector<TestObject*> vec_obj;
-	vector<vector<TestObject*>> forced_clusters;
+			const unsigned int num_clusters = Cluster::CreateClusters(all_objects, context->clusters_, context->pool_);
 
-	vec_obj.resize(num_objects);
-	for (int i = 0; i < num_objects; i++)
+			dtlb_misses.Stop();
+			std::chrono::system_clock::time_point time_1 = std::chrono::system_clock::now();
+			all_time_us += std::chrono::duration_cast<std::chrono::microseconds>(time_1 - time_0).count();
+			all_dtlb_misses += dtlb_misses.Read();
+
+			for (unsigned int cluster_idx = 0; cluster_idx < num_clusters; cluster_idx++)
+			{
+				Cluster& cluster = context->clusters_[cluster_idx];
+				for (auto obj : cluster.GetObjects())
+				{
+					obj->SetClusterIndex(kNullIndex);
+				}
+				cluster.Reset<false>();
+			}
+		}
+		std::clog << SmartStackStuff::ToString(requested_backing)
+			<< " (got " << SmartStackStuff::ToString(context->pool_.GetBacking()) << ")"
+			<< " CreateClusters [us]: " << all_time_us / repeat;
+		if (dtlb_misses.IsValid())
+		{
+			std::clog << " " << ToString(EPerfEvent::DTLBLoadMisses) << ": " << all_dtlb_misses / repeat;
+		}
+		std::clog << std::endl;
+	}
+}
+
+static void PrintSchedule(const FrameScheduler& scheduler)
+{
+	std::clog << "clusters: " << scheduler.GetNumClusters() << std::endl;
+	for (unsigned int cluster_idx = 0; cluster_idx < scheduler.GetNumClusters(); cluster_idx++)
 	{
-		vec_obj[i] = new TestObject();
+		std::clog << scheduler.GetClusters()[cluster_idx].GetObjects().size() << " \t";
 	}
-	const bool use_forced_clusters = forced_clusters_num > 1;
-	if (use_forced_clusters)
+	std::clog << std::endl << "groups: " << scheduler.GetNumGroups() << std::endl;
+	for (unsigned int group_idx = 0; group_idx < scheduler.GetNumGroups(); group_idx++)
 	{
-		forced_clusters.clear();
-		forced_clusters.resize(forced_clusters_num);
+		const GroupOfConcurrentClusters& group = scheduler.GetGroup(group_idx);
+		std::clog << group_idx << "[" << group.clusters_.size() << "]\t ";
+		for (auto cluster : group.clusters_)
+		{
+			std::clog << cluster->GetObjects().size() << "\t ";
+		}
+		std::clog << std::endl;
 	}
+}
 
-	for (int i = 0; i < num_objects; i++)
+// Hardware counters around every phase. Only the calling thread is counted - parallel phases show just its share.
+static void ProfilePhases(const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, int num_frames)
+{
+	PerfCounterGroup counters;
+	std::clog << std::endl << "Hardware counters (per frame, calling thread only):" << std::endl;
+	if (!counters.IsValid())
 	{
-		TestObject& obj = *vec_obj[i];
-		obj.id_ = i;
-		if (use_forced_clusters)
-		{
-			{
-				std::uniform_int_distribution<int> cluster_distribution(0, forced_clusters_num - 1);
-				const int forced_cluster_idx = cluster_distribution(generator);
-				vector<TestObject*>& cluster = forced_clusters[forced_cluster_idx];
-				const size_t actual_dependency_num = std::min<size_t>(dependencies_num, cluster.size());
-				if (actual_dependency_num > 0)
-				{
-					std::uniform_int_distribution<size_t> dependency_distribution(0, cluster.size() - 1);
-					for (int j = 0; j < dependencies_num; j++)
-					{
-						auto dep_obj = cluster[dependency_distribution(generator)];
-						obj.dependencies_.emplace_back(dep_obj);
-					}
-				}
-				cluster.push_back(&obj);
-			}
+		std::clog << "perf events are not available" << std::endl;
+		return;
+	}
 
+	const char* phase_names[] = { "CreateClusters", "CreateClustersDependencies", "GenerateClusterGroups", "Execution" };
+	PerfSample phase_samples[4];
+	auto measure = [&](int phase_idx, auto&& phase)
+	{
+		counters.Start();
+		phase();
+		counters.Stop();
+		phase_samples[phase_idx] += counters.Read();
+	};
+	for (int i = 0; i < num_frames; i++)
+	{
+		measure(0, [&]() { scheduler.CreateClusters(all_objects); });
+		measure(1, [&]() { scheduler.CreateClustersDependencies(); });
+		measure(2, [&]() { scheduler.GenerateClusterGroups(); });
+		measure(3, [&]() { scheduler.Execute(); });
+	}
+
+	const double num_objects = static_cast<double>(all_objects.size()) * num_frames;
+	for (int phase_idx = 0; phase_idx < 4; phase_idx++)
+	{
+		const PerfSample& sample = phase_samples[phase_idx];
+		std::clog << phase_names[phase_idx] << ":";
+		for (size_t i = 0; i < static_cast<size_t>(EPerfEvent::Count); i++)
+		{
+			const auto event = static_cast<EPerfEvent>(i);
+			if (counters.IsValid(event))
 			{
-				//Const deps goes only to the first num_of_const_dep_sources clusters
-				const int num_of_const_dep_sources = 8;
-				std::uniform_int_distribution<size_t> const_dep_source_dependency_distribution(0, num_of_const_dep_sources);
-				const auto forced_cluster_idx = const_dep_source_dependency_distribution(generator);
-				const vector<TestObject*>& cluster = forced_clusters[forced_cluster_idx];
-				const size_t actual_dependency_num = std::min<size_t>(const_dependencies_num, cluster.size());
-				if (actual_dependency_num > 0)
-				{
-					std::uniform_int_distribution<size_t> dependency_distribution(0, cluster.size() - 1);
-					for (int j = 0; j < const_dependencies_num; j++)
-					{
-						auto dep_obj = cluster[dependency_distribution(generator)];
-						obj.const_dependencies_.emplace_back(dep_obj);
-					}
-				}
+				std::clog << " " << ToString(event) << ": " << sample.Get(event) / num_frames;
 			}
 		}
-		else
+		if (counters.IsValid(EPerfEvent::Cycles) && counters.IsValid(EPerfEvent::Instructions) && sample.Get(EPerfEvent::Instructions))
 		{
-			std::uniform_int_distribution<int> dependency_distribution(0, num_objects - 1);
-			for (int j = 0; j < dependencies_num; j++)
-			{
-				auto dep_obj = vec_obj[dependency_distribution(generator)];
-				obj.dependencies_.emplace_back(dep_obj);
-			}
-
-			for (int j = 0; j < const_dependencies_num; j++)
+			std::clog << " CPI: " << static_cast<double>(sample.Get(EPerfEvent::Cycles)) / sample.Get(EPerfEvent::Instructions);
+		}
+		for (auto event : { EPerfEvent::L1DReadMisses, EPerfEvent::LLCMisses, EPerfEvent::DTLBLoadMisses, EPerfEvent::BranchMisses })
+		{
+			if (counters.IsValid(event))
 			{
-				auto const_dep_obj = vec_obj[dependency_distribution(generator)];
-				obj.const_dependencies_.emplace_back(const_dep_obj);
+				std::clog << " " << ToString(event) << "/object: " << sample.Get(event) / num_objects;
 			}
 		}
+		std::clog << std::endl;
 	}
+}
 
-	std::cout << "Objects were generated." << std::endl;
+// Records a few frames and writes them as Chrome Trace Event JSON (open in chrome://tracing or Perfetto).
+static void TraceFrames(const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, int num_frames, const char* file_name)
+{
+	Tracer::Clear();
+	Tracer::Enable(true);
+	for (int i = 0; i < num_frames; i++)
+	{
+		MTO_TRACE_SCOPE_ARG("Frame", "index", i);
+		scheduler.ExecuteFrame(all_objects);
+	}
+	Tracer::Enable(false);
 
-	return vec_obj;
+	std::ofstream file(file_name);
+	Tracer::WriteChromeTrace(file);
+	std::clog << std::endl << "Trace of " << num_frames << " frames written to: " << file_name << std::endl;
 }
 
-static vector<IThreadSafeObject*> ShuffleObjects(vector<TestObject*>& vec_obj)
+static void PrintFrameStats(const FrameStats& stats)
 {
-	vector<IThreadSafeObject*> all_objects;
-	all_objects.reserve(vec_obj.size());
-	for (unsigned int i = 0; i < vec_obj.size(); i++)
+	std::clog << std::endl << "Last frame stats:" << std::endl;
+	for (size_t i = 0; i < static_cast<size_t>(EStat::Count); i++)
 	{
-		all_objects.emplace_back(vec_obj[i]);
+		std::clog << ToString(static_cast<EStat>(i)) << ": " << stats.Get(static_cast<EStat>(i)) << std::endl;
 	}
-
-	std::mt19937 randomizer;
-	std::shuffle(all_objects.begin(), all_objects.end(), randomizer);
-	return all_objects;
+	for (size_t i = 0; i < static_cast<size_t>(EStatMax::Count); i++)
+	{
+		std::clog << ToString(static_cast<EStatMax>(i)) << ": " << stats.Get(static_cast<EStatMax>(i)) << std::endl;
+	}
+	std::clog << "chunks_in_use: " << stats.chunks_in_use_ << std::endl;
+	std::clog << "max_chunks_in_use: " << stats.max_chunks_in_use_ << " / " << stats.chunks_capacity_ << std::endl;
+	std::clog << "telemetry_slots: " << Telemetry::GetNumSlots() << std::endl;
 }
 
-static long long Test(const vector<IThreadSafeObject*>& all_objects, ClusterArray& clusters, bool verbose)
+// Steady state frames of a FrameScheduler must not touch the heap.
+static bool TestNoAllocationsPerFrame(const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, int num_frames)
 {
-	std::cout << std::endl;
-	long long ms = 0;
-	int num_clusters = 0;
+	scheduler.ExecuteFrame(all_objects); // warm up
+
+	AllocationCounter::Enable(true);
+	unsigned long long allocations[4] = {};
+	for (int i = 0; i < num_frames; i++)
 	{
-		std::chrono::system_clock::time_point time_0 = std::chrono::system_clock::now();
+		unsigned long long counter = AllocationCounter::Get();
+		scheduler.CreateClusters(all_objects);
+		allocations[0] += AllocationCounter::Get() - counter;
 
-		num_clusters = Cluster::CreateClusters(all_objects, clusters);
+		counter = AllocationCounter::Get();
+		scheduler.CreateClustersDependencies();
+		allocations[1] += AllocationCounter::Get() - counter;
 
-		std::chrono::system_clock::time_point time_1 = std::chrono::system_clock::now();
-		std::chrono::system_clock::duration duration = time_1 - time_0;
-		ms = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-		std::cout << "GenerateClusters [ms]: " << ms << std::endl;
+		counter = AllocationCounter::Get();
+		scheduler.GenerateClusterGroups();
+		allocations[2] += AllocationCounter::Get() - counter;
+
+		counter = AllocationCounter::Get();
+		scheduler.Execute();
+		allocations[3] += AllocationCounter::Get() - counter;
+	}
+	AllocationCounter::Enable(false);
+
+	const unsigned long long all_allocations = allocations[0] + allocations[1] + allocations[2] + allocations[3];
+	std::clog << std::endl << "Heap allocations in " << num_frames << " frames"
+		<< " CreateClusters: " << allocations[0]
+		<< " CreateClustersDependencies: " << allocations[1]
+		<< " GenerateClusterGroups: " << allocations[2]
+		<< " Execution: " << allocations[3]
+		<< (all_allocations ? " FAILED" : " OK") << std::endl;
+	return 0 == all_allocations;
+}
 
-		if (verbose)
+/*
+SmartStack::Compact on a container kept across frames. It grows interleaved with a per-frame one, so its chain alternates
+with freed chunks, and is compacted between frames. The elements and the chunks in use must stay, the chain must become one run.
+*/
+static bool TestStackCompaction(FrameScheduler& scheduler, int num_elements, int repeat)
+{
+	ChunkMemoryPool& pool = scheduler.GetContext().pool_;
+	const unsigned int chunks_before = pool.GetNumChunksAllocated();
+	FastContainer<IThreadSafeObject*> kept(pool);
+	{
+		FastContainer<IThreadSafeObject*> per_frame(pool);
+		for (int idx = 0; idx < num_elements; idx++)
+		{
+			kept.push_back<false>(reinterpret_cast<IThreadSafeObject*>(static_cast<uintptr_t>(idx + 1)));
+			per_frame.push_back<false>(nullptr);
+		}
+	}
+	auto scan_us = [&]()
+	{
+		uintptr_t sum = 0;
+		const auto time_0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeat; i++)
 		{
-			std::cout << " : ";
-			int num_empty = 0;
-			for (auto& cluster : clusters)
+			for (IThreadSafeObject* obj : kept)
 			{
-				if (cluster.GetObjects().empty())
-				{
-					num_empty++;
-				}
-				else if (verbose)
-				{
-					std::cout << cluster.GetObjects().size() << " \t";
-				}
+				sum += reinterpret_cast<uintptr_t>(obj);
 			}
-			std::cout << std::endl << "AllClusters: " << clusters.size()
-				<< " Empty: " << num_empty
-				<< " Clusters: " << (clusters.size() - num_empty)
-				<< std::endl;
 		}
+		const double time_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - time_0).count() / repeat;
+		return (sum == static_cast<uintptr_t>(repeat) * num_elements * (num_elements + 1ull) / 2) ? time_us : -1.0;
+	};
+	const unsigned int breaks_before = kept.CountChunkBreaks();
+	const double scan_before_us = scan_us();
+	const unsigned int num_moved = kept.Compact();
+	const unsigned int breaks_after = kept.CountChunkBreaks();
+	const double scan_after_us = scan_us();
+
+	int expected = 1;
+	bool in_order = true;
+	for (IThreadSafeObject* obj : kept)
+	{
+		in_order = in_order && reinterpret_cast<uintptr_t>(obj) == static_cast<uintptr_t>(expected++);
 	}
+	kept.clear<false>();
+	const bool ok = in_order && expected == num_elements + 1 && num_moved && 0 == breaks_after && scan_after_us >= 0.0
+		&& pool.GetNumChunksAllocated() == chunks_before;
+	std::clog << std::endl << "Stack compaction of " << num_elements << " elements, moved chunks: " << num_moved
+		<< " breaks: " << breaks_before << " -> " << breaks_after << " scan [us]: " << scan_before_us << " -> " << scan_after_us
+		<< (ok ? " OK" : " FAILED") << std::endl;
+	return ok;
+}
 
-	IF_TEST_STUFF(Cluster::Test_AreClustersCoherent(clusters, num_clusters));
+/*
+A frame budget that every frame misses, with the schedule cache on and off. Low clusters are deferred, caught up promoted in
+the next frame and deferred again after it. The cache must not change that sequence, also when it's enabled right after a
+frame that deferred objects.
+*/
+static bool TestScheduleCacheWithDeferral(int num_frames)
+{
+	BenchmarkCase test_case;
+	test_case.num_objects_ = 4096;
+	test_case.forced_clusters_ = 32;
+	test_case.low_percent_ = 100;
+	std::default_random_engine generator(0);
+	auto objects = GenerateObjects(test_case, generator);
+	AssignPriorities(test_case, objects);
+	const vector<IThreadSafeObject*> all_objects = ShuffleObjects(objects);
+
+	auto scheduler = std::make_unique<FrameScheduler>();
+	vector<unsigned int> deferred[2];
+	for (int use_cache = 0; use_cache < 2; use_cache++)
+	{
+		scheduler->EnableScheduleCache(false);
+		scheduler->SetFrameBudget(0.0f);
+		scheduler->ExecuteFrame(all_objects); // runs the objects deferred before
+		scheduler->SetFrameBudget(1.0f);
+		scheduler->ExecuteFrame(all_objects); // defers the low clusters
+		scheduler->EnableScheduleCache(0 != use_cache);
+		for (int i = 0; i < num_frames; i++)
+		{
+			scheduler->ExecuteFrame(all_objects);
+			deferred[use_cache].push_back(scheduler->GetLastFrameDeferredObjects());
+		}
+	}
+	scheduler->SetFrameBudget(0.0f);
+	scheduler->ExecuteFrame(all_objects);
+	DestroyObjects(objects);
 
-	vector<IndexSet> dependency_sets;
+	const bool ok = (deferred[0] == deferred[1]) && num_frames > 1 && deferred[0][1];
+	std::clog << std::endl << "Deferred objects per frame with a frame budget, schedule cache off / on:";
+	for (int i = 0; i < num_frames; i++)
 	{
-		std::chrono::system_clock::time_point time_1 = std::chrono::system_clock::now();
+		std::clog << " " << deferred[0][i] << "/" << deferred[1][i];
+	}
+	std::clog << (ok ? " OK" : " FAILED") << std::endl;
+	return ok;
+}
 
-		dependency_sets = Cluster::CreateClustersDependencies(clusters, num_clusters);
+/*
+ExecutePhases against its reference order: every phase as a whole frame of its own. The objects derive their state from
+the const dependencies, so any ordering difference changes the final states.
+*/
+static bool TestPhaseGraphEquivalence(unsigned int num_phases, int num_frames)
+{
+	BenchmarkCase test_case;
+	test_case.num_objects_ = 16 * 1024;
+	test_case.forced_clusters_ = 64;
+	std::default_random_engine generator(0);
+	auto objects = GenerateObjects(test_case, generator);
+	const vector<IThreadSafeObject*> all_objects = ShuffleObjects(objects);
+	for (TestObject* obj : objects)
+	{
+		obj->update_state_ = true;
+	}
 
-		std::chrono::system_clock::time_point time_2 = std::chrono::system_clock::now();
-		std::chrono::system_clock::duration duration = time_2 - time_1;
-		auto duration_ms = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-		ms += duration_ms;
-		std::cout << "CreateClustersDependencies [ms]: " << duration_ms << std::endl;
+	auto scheduler = std::make_unique<FrameScheduler>();
+	vector<uint64_t> states[2];
+	for (int phase_graph = 0; phase_graph < 2; phase_graph++)
+	{
+		for (TestObject* obj : objects)
+		{
+			obj->state_ = 0;
+		}
+		for (int i = 0; i < num_frames; i++)
+		{
+			if (phase_graph)
+			{
+				scheduler->ExecuteFrame(all_objects, num_phases);
+				continue;
+			}
+			for (unsigned int phase = 0; phase < num_phases; phase++)
+			{
+				scheduler->ExecuteFrame(all_objects);
+			}
+		}
+		for (TestObject* obj : objects)
+		{
+			states[phase_graph].push_back(obj->state_);
+		}
 	}
+	DestroyObjects(objects);
+
+	const bool ok = states[0] == states[1];
+	std::clog << std::endl << "Object states after " << num_frames << " frames of " << num_phases << " phases, phase graph vs phase by phase:"
+		<< (ok ? " OK" : " FAILED") << std::endl;
+	return ok;
+}
 
-	vector<GroupOfConcurrentClusters> groups;
+struct CommandLine
+{
+	vector<EGraphShape> shapes_ = { EGraphShape::ForcedClusters };
+	vector<int> num_objects_ = { 64 * 1024 };
+	vector<int> forced_clusters_ = { 64 };
+	vector<int> dependencies_num_ = { 16 };
+	vector<int> const_dependencies_num_ = { 8 };
+	vector<int> const_locality_percent_ = { 50 };
+	vector<int> num_threads_ = { 0 };
+	vector<EClusteringAlgorithm> algorithms_ = { EClusteringAlgorithm::Default, EClusteringAlgorithm::Experimental };
+	vector<int> schedule_cache_ = { 0 };
+	vector<int> group_worker_pool_ = { 1 };
+	vector<int> adaptive_dispatch_ = { 1 };
+	vector<int> phase_graph_ = { 1 };
+	vector<int> graph_changes_percent_ = { 0 };
+	vector<int> frame_budget_us_ = { 0 };
+	vector<int> time_slice_us_ = { 0 };
+	vector<int> churn_percent_ = { 0 };
+	vector<int> prefetch_distance_ = { static_cast<int>(FrameScheduler::kDefaultPrefetchDistance) };
+	int critical_percent_ = 0;
+	int low_percent_ = 0;
+	int task_work_ = 0;
+	int task_memory_ = 0;
+	int heavy_percent_ = 0;
+	int num_phases_ = 1;
+	int shards_ = 0;
+#ifdef TEST_STUFF
+	int repeat_ = 1;
+	int warmup_ = 0;
+	bool verbose_ = true;
+#else
+	int repeat_ = 256;
+	int warmup_ = 4;
+	bool verbose_ = false;
+#endif
+	unsigned int seed_ = 0;
+	bool diagnostics_ = false;
+	bool barrier_benchmark_ = false;
+	std::string output_;
+	std::string trace_;
+	std::string capture_;
+	std::string simulate_;
+	bool simulate_estimated_ = false;
+	std::string replay_;
+	std::string decision_log_;
+	std::string telemetry_baseline_;
+
+	static void PrintUsage()
 	{
-		std::chrono::system_clock::time_point time_1 = std::chrono::system_clock::now();
+		std::clog << "Usage: MTObjects [options]" << std::endl
+			<< "Lists are comma separated, every combination is run." << std::endl
+			<< "  --shape LIST            forced_clusters, power_law, grid, chains, islands (default forced_clusters)" << std::endl
+			<< "  --objects LIST          number of objects (default 65536)" << std::endl
+			<< "  --forced-clusters LIST  objects are randomly assigned into that many clusters, <= 1 means uniform random dependencies." << std::endl
+			<< "                          For the other shapes the number of communities, tiles, chains or islands (default 64)" << std::endl
+			<< "  --deps LIST             dependencies per object (default 16)" << std::endl
+			<< "  --const-deps LIST       const dependencies per object (default 8)" << std::endl
+			<< "  --const-locality LIST   % of const dependencies inside the own or a neighbouring region, not used by forced_clusters (default 50)" << std::endl
+			<< "  --threads LIST          worker threads, 0 - all hardware threads (default 0)" << std::endl
+			<< "  --algorithm LIST        default, experimental, batched, adaptive (default: default and experimental)" << std::endl
+			<< "  --decision-log FILE     write the decisions of the adaptive algorithm (JSON lines)" << std::endl
+			<< "  --schedule-cache LIST   0 - off, 1 - restore the schedule of frames with the same graph (default 0)" << std::endl
+			<< "  --group-pool LIST       0 - a Parallel::ForEach per group, 1 - the persistent group worker pool (default 1)" << std::endl
+			<< "  --adaptive-dispatch LIST 0 - off, 1 - the group worker pool runs tiny groups inline and tiny clusters in batches (default 1)" << std::endl
+			<< "  --graph-changes LIST    % of frames that change the graph, not used by replay (default 0)" << std::endl
+			<< "  --frame-budget LIST     frame deadline [us], low priority clusters may be deferred after it, 0 - none (default 0)" << std::endl
+			<< "  --critical-percent N    % of objects with critical priority, not used by replay (default 0)" << std::endl
+			<< "  --low-percent N         % of objects with low priority, not used by replay (default 0)" << std::endl
+			<< "  --task-work N           loop iterations of every Task, not used by replay (default 0)" << std::endl
+			<< "  --task-memory N         bytes of payload every Task reads and writes, not used by replay (default 0)" << std::endl
+			<< "  --prefetch LIST         objects prefetched ahead within a cluster during execution, 0 - off (default " << FrameScheduler::kDefaultPrefetchDistance << ")" << std::endl
+			<< "  --heavy-percent N       % of objects with " << kHeavyWorkFactor << " times the task work, cooperative with C++20, not used by replay (default 0)" << std::endl
+			<< "  --time-slice LIST       time slice of a cluster [us] for cooperative objects, needs C++20, 0 - run to completion (default 0)" << std::endl
+			<< "  --churn LIST            % of objects that spawn a short-lived object in every task, through an ObjectRegistry, not used by replay (default 0)" << std::endl
+			<< "  --phases N              tasks of every object per frame (at most " << PhaseGraph::kMaxPhases << ", default 1)" << std::endl
+			<< "  --phase-graph LIST      with phases: 0 - the whole frame once per phase, 1 - one clustering and FrameScheduler::ExecutePhases (default 1)" << std::endl
+			<< "  --shards N              run every graph in N processes (Linux), with the first thread count per process and the first algorithm." << std::endl
+			<< "                          Exit code 1 if a shard fails or the checksum differs from a single process run" << std::endl
+			<< "  --repeat N              measured frames per variant (default 256)" << std::endl
+			<< "  --warmup N              not measured frames per variant (default 4)" << std::endl
+			<< "  --seed N                seed of the object generator (default 0)" << std::endl
+			<< "  --output FILE           JSON results file (default stdout)" << std::endl
+			<< "  --trace FILE            write a Chrome trace of a few frames of the first variant" << std::endl
+			<< "  --capture FILE          write the dependency graph of the first variant (GraphCapture.h)" << std::endl
+			<< "  --simulate FILE         write a simulation of the first variant for 1 to " << ScheduleSimulator::kMaxWorkers << " virtual workers (ScheduleSimulator.h)" << std::endl
+			<< "  --simulate-costs TYPE   measured - the cluster times of the executed frame [ns], estimated - IThreadSafeObject::GetCost (default measured)" << std::endl
+			<< "  --replay FILE           run the captured graph instead of the generated ones" << std::endl
+			<< "  --barrier-bench         only measure the handoff latency between groups for every thread count" << std::endl
+			<< "  --telemetry-baseline FILE  JSON results of a build with MTOBJECTS_TELEMETRY=0 and the same options, prints the telemetry overhead" << std::endl
+			<< "  --diagnostics           page backing, allocation and hardware counter checks of the first variant, exit code 1 if a check fails" << std::endl
+			<< "  --verbose               print the schedule of the first variant" << std::endl;
+	}
 
-		groups = GroupOfConcurrentClusters::GenerateClusterGroups(clusters, dependency_sets);
+	static vector<int> ParseList(const std::string& text)
+	{
+		vector<int> result;
+		size_t begin = 0;
+		while (begin <= text.size())
+		{
+			const size_t end = std::min(text.find(',', begin), text.size());
+			result.push_back(std::atoi(text.substr(begin, end - begin).c_str()));
+			begin = end + 1;
+		}
+		return result;
+	}
 
-		std::chrono::system_clock::time_point time_2 = std::chrono::system_clock::now();
-		std::chrono::system_clock::duration duration = time_2 - time_1;
-		auto duration_ms = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-		ms += duration_ms;
-		std::cout << "GenerateClusterGroups [ms]: " << duration_ms << std::endl;
-		if (verbose)
+	bool Parse(int argc, char** argv)
+	{
+		for (int arg_idx = 1; arg_idx < argc; arg_idx++)
 		{
-			std::cout << "groups: " << groups.size() << std::endl;
-			for (unsigned int group_idx = 0; group_idx < groups.size(); group_idx++)
+			const std::string arg = argv[arg_idx];
+			const bool has_value = (arg_idx + 1) < argc;
+			if ("--verbose" == arg) { verbose_ = true; continue; }
+			if ("--diagnostics" == arg) { diagnostics_ = true; continue; }
+			if ("--barrier-bench" == arg) { barrier_benchmark_ = true; continue; }
+			if ("--help" == arg || !has_value) { return false; }
+
+			const std::string value = argv[++arg_idx];
+			if ("--objects" == arg) { num_objects_ = ParseList(value); }
+			else if ("--forced-clusters" == arg) { forced_clusters_ = ParseList(value); }
+			else if ("--deps" == arg) { dependencies_num_ = ParseList(value); }
+			else if ("--const-deps" == arg) { const_dependencies_num_ = ParseList(value); }
+			else if ("--const-locality" == arg) { const_locality_percent_ = ParseList(value); }
+			else if ("--threads" == arg) { num_threads_ = ParseList(value); }
+			else if ("--schedule-cache" == arg) { schedule_cache_ = ParseList(value); }
+			else if ("--group-pool" == arg) { group_worker_pool_ = ParseList(value); }
+			else if ("--adaptive-dispatch" == arg) { adaptive_dispatch_ = ParseList(value); }
+			else if ("--graph-changes" == arg) { graph_changes_percent_ = ParseList(value); }
+			else if ("--frame-budget" == arg) { frame_budget_us_ = ParseList(value); }
+			else if ("--critical-percent" == arg) { critical_percent_ = std::min(std::max(std::atoi(value.c_str()), 0), 100); }
+			else if ("--low-percent" == arg) { low_percent_ = std::min(std::max(std::atoi(value.c_str()), 0), 100); }
+			else if ("--task-work" == arg) { task_work_ = std::max(0, std::atoi(value.c_str())); }
+			else if ("--heavy-percent" == arg) { heavy_percent_ = std::min(std::max(std::atoi(value.c_str()), 0), 100); }
+			else if ("--phases" == arg) { num_phases_ = std::min(std::max(std::atoi(value.c_str()), 1), static_cast<int>(PhaseGraph::kMaxPhases)); }
+			else if ("--phase-graph" == arg) { phase_graph_ = ParseList(value); }
+			else if ("--time-slice" == arg) { time_slice_us_ = ParseList(value); }
+			else if ("--churn" == arg) { churn_percent_ = ParseList(value); }
+			else if ("--task-memory" == arg) { task_memory_ = std::max(0, std::atoi(value.c_str())); }
+			else if ("--prefetch" == arg) { prefetch_distance_ = ParseList(value); }
+			else if ("--shards" == arg) { shards_ = std::min(std::max(std::atoi(value.c_str()), 0), static_cast<int>(Sharding::kMaxShards)); }
+			else if ("--repeat" == arg) { repeat_ = std::max(1, std::atoi(value.c_str())); }
+			else if ("--warmup" == arg) { warmup_ = std::max(0, std::atoi(value.c_str())); }
+			else if ("--seed" == arg) { seed_ = static_cast<unsigned int>(std::atoi(value.c_str())); }
+			else if ("--output" == arg) { output_ = value; }
+			else if ("--simulate" == arg) { simulate_ = value; }
+			else if ("--simulate-costs" == arg) { simulate_estimated_ = ("estimated" == value); }
+			else if ("--trace" == arg) { trace_ = value; }
+			else if ("--capture" == arg) { capture_ = value; }
+			else if ("--replay" == arg) { replay_ = value; }
+			else if ("--decision-log" == arg) { decision_log_ = value; }
+			else if ("--telemetry-baseline" == arg) { telemetry_baseline_ = value; }
+			else if ("--shape" == arg)
 			{
-				const GroupOfConcurrentClusters& group = groups[group_idx];
-				std::cout << group_idx << "[" << group.clusters_.size() << "]\t ";
-
-				for (unsigned int cluster_idx = 0; cluster_idx < group.clusters_.size(); cluster_idx++)
+				shapes_.clear();
+				for (unsigned char shape_idx = 0; shape_idx < static_cast<unsigned char>(EGraphShape::Replay); shape_idx++)
 				{
-					auto& cluster = group.clusters_[cluster_idx];
-					std::cout << cluster->GetObjects().size() << "\t ";
+					const EGraphShape shape = static_cast<EGraphShape>(shape_idx);
+					if (std::string::npos != value.find(ToString(shape))) { shapes_.push_back(shape); }
 				}
-				std::cout << std::endl;
+				if (shapes_.empty()) { return false; }
+			}
+			else if ("--algorithm" == arg)
+			{
+				algorithms_.clear();
+				if (std::string::npos != value.find("default")) { algorithms_.push_back(EClusteringAlgorithm::Default); }
+				if (std::string::npos != value.find("experimental")) { algorithms_.push_back(EClusteringAlgorithm::Experimental); }
+				if (std::string::npos != value.find("batched")) { algorithms_.push_back(EClusteringAlgorithm::Batched); }
+				if (std::string::npos != value.find("adaptive")) { algorithms_.push_back(EClusteringAlgorithm::Adaptive); }
+				if (algorithms_.empty()) { return false; }
 			}
+			else { return false; }
 		}
+		return true;
 	}
+};
 
+// Runs every thread count and algorithm of the command line on the objects. The extras run only once, after the first variant.
+// Returns false if a --diagnostics check failed.
+static bool RunVariants(const CommandLine& command_line, const BenchmarkCase& graph_case, const vector<IThreadSafeObject*>& all_objects, FrameScheduler& scheduler, vector<BenchmarkResult>& results,
+	vector<TestObject*>* changeable_objects)
+{
+	bool checks_passed = true;
+	for (int num_threads : command_line.num_threads_)
+	for (auto algorithm : command_line.algorithms_)
+	for (int schedule_cache : command_line.schedule_cache_)
+	for (int group_worker_pool : command_line.group_worker_pool_)
+	for (int adaptive_dispatch : command_line.adaptive_dispatch_)
+	for (int phase_graph : command_line.phase_graph_)
+	for (int graph_changes_percent : command_line.graph_changes_percent_)
+	for (int frame_budget_us : command_line.frame_budget_us_)
+	for (int time_slice_us : command_line.time_slice_us_)
+	for (int churn_percent : command_line.churn_percent_)
+	for (int prefetch_distance : command_line.prefetch_distance_)
 	{
-		std::chrono::system_clock::time_point time_1 = std::chrono::system_clock::now();
+		BenchmarkCase benchmark_case = graph_case;
+		benchmark_case.num_threads_ = static_cast<unsigned int>(std::max(0, num_threads));
+		benchmark_case.algorithm_ = algorithm;
+		benchmark_case.schedule_cache_ = 0 != schedule_cache;
+		benchmark_case.group_worker_pool_ = 0 != group_worker_pool;
+		benchmark_case.adaptive_dispatch_ = 0 != adaptive_dispatch;
+		benchmark_case.phase_graph_ = 0 != phase_graph;
+		benchmark_case.graph_changes_percent_ = changeable_objects ? graph_changes_percent : 0;
+		benchmark_case.frame_budget_us_ = static_cast<float>(std::max(0, frame_budget_us));
+		benchmark_case.time_slice_us_ = static_cast<float>(std::max(0, time_slice_us));
+		benchmark_case.churn_percent_ = changeable_objects ? std::min(std::max(churn_percent, 0), 100) : 0;
+		benchmark_case.prefetch_distance_ = static_cast<unsigned int>(std::max(0, prefetch_distance));
+
+		std::clog << "shape: " << ToString(graph_case.shape_) << " objects: " << graph_case.num_objects_ << " forced_clusters: " << graph_case.forced_clusters_
+			<< " deps: " << graph_case.dependencies_num_ << " const_deps: " << graph_case.const_dependencies_num_ << " const_locality: " << graph_case.const_locality_
+			<< " threads: " << num_threads << " algorithm: " << ToString(algorithm)
+			<< " schedule_cache: " << schedule_cache << " group_pool: " << group_worker_pool << " adaptive_dispatch: " << adaptive_dispatch << " graph_changes: " << benchmark_case.graph_changes_percent_
+			<< " frame_budget: " << benchmark_case.frame_budget_us_ << " time_slice: " << benchmark_case.time_slice_us_
+			<< " phases: " << benchmark_case.num_phases_ << " phase_graph: " << phase_graph << " churn: " << benchmark_case.churn_percent_ << " prefetch: " << benchmark_case.prefetch_distance_ << std::endl;
+		results.push_back(RunBenchmarkCase(benchmark_case, all_objects, scheduler, command_line.warmup_, command_line.repeat_, changeable_objects));
+		std::clog << "median frame [us]: " << results.back().frame_us_.median_ << " p99: " << results.back().frame_us_.p99_ << std::endl;
+		if (benchmark_case.frame_budget_us_ > 0.0f)
+		{
+			std::clog << "deadline misses: " << results.back().deadline_misses_ << " / " << results.back().repeat_
+				<< " deferred clusters per frame: " << results.back().deferred_clusters_per_frame_ << std::endl;
+		}
+		if (benchmark_case.time_slice_us_ > 0.0f)
+		{
+			std::clog << "clusters yielded per frame: " << results.back().clusters_yielded_per_frame_ << std::endl;
+		}
+		if (benchmark_case.ReportsDispatch() && benchmark_case.adaptive_dispatch_)
+		{
+			std::clog << "groups inlined per frame: " << results.back().groups_inlined_per_frame_ << " cluster batches per frame: " << results.back().cluster_batches_per_frame_
+				<< " thresholds [objects] inline: " << results.back().inline_threshold_ << " batch: " << results.back().batch_threshold_ << std::endl;
+		}
+		if (benchmark_case.schedule_cache_)
+		{
+			std::clog << "schedule cache hit rate: " << results.back().schedule_cache_hit_rate_
+				<< " saved per frame [us]: " << results.back().schedule_cache_saved_us_per_frame_ << std::endl;
+		}
 
-		for (auto& group : groups)
+		if (1 == results.size())
 		{
-			group.ExecuteGroup();
+			if (command_line.verbose_)
+			{
+				scheduler.CreateClusters(all_objects);
+				scheduler.CreateClustersDependencies();
+				scheduler.GenerateClusterGroups();
+				PrintSchedule(scheduler);
+				scheduler.Execute();
+				PrintFrameStats(scheduler.GetLastFrameStats());
+			}
+			if (command_line.diagnostics_)
+			{
+				BenchmarkPageBacking(all_objects, 64);
+				checks_passed = TestNoAllocationsPerFrame(all_objects, scheduler, 16) && checks_passed;
+				checks_passed = TestStackCompaction(scheduler, 256 * 1024, 16) && checks_passed;
+				checks_passed = TestScheduleCacheWithDeferral(8) && checks_passed;
+				checks_passed = TestPhaseGraphEquivalence(3, 4) && checks_passed;
+				ProfilePhases(all_objects, scheduler, 64);
+			}
+			if (!command_line.trace_.empty())
+			{
+				TraceFrames(all_objects, scheduler, 4, command_line.trace_.c_str());
+			}
+			if (!command_line.simulate_.empty())
+			{
+				const bool measured_costs = !command_line.simulate_estimated_;
+				const ScheduleSimulation simulation = SimulateSchedule(all_objects, scheduler, measured_costs);
+				std::clog << "simulated speedup ceiling groups: " << simulation.GetGroupsSpeedupCeiling() << " graph: " << simulation.GetGraphSpeedupCeiling()
+					<< " critical chain: " << simulation.critical_chain_.size() << " clusters" << std::endl;
+				for (const SimulatedWorkers& workers : simulation.workers_)
+				{
+					std::clog << "simulated workers: " << workers.num_workers_ << " speedup groups: " << workers.groups_speedup_ << " graph: " << workers.graph_speedup_
+						<< " utilization: " << workers.utilization_ << std::endl;
+				}
+				std::ofstream file(command_line.simulate_);
+				WriteJson(file, simulation, measured_costs);
+				std::clog << "Simulation written to: " << command_line.simulate_ << std::endl;
+			}
+			if (!command_line.capture_.empty())
+			{
+				std::ofstream file(command_line.capture_, std::ios::binary);
+				const bool captured = CaptureGraph(all_objects, scheduler.GetContext().pool_, file);
+				std::clog << (captured ? "Graph captured to: " : "Graph capture failed: ") << command_line.capture_ << std::endl;
+			}
 		}
+	}
+	return checks_passed;
+}
 
-		std::chrono::system_clock::time_point time_2 = std::chrono::system_clock::now();
-		std::chrono::system_clock::duration duration = time_2 - time_1;
-		auto duration_ms = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-		ms += duration_ms;
-		std::cout << "Execution [ms]: " << duration_ms << std::endl;
+// The clusters of this many objects fit into half of the chunk pool.
+static const constexpr int kMaxObjects = ChunkMemoryPool::kNumberChunks * FastContainer<IThreadSafeObject*>::kElementsPerChunk / 2;
+
+// Returns false if the capture can't be replayed, out_checks_passed - see RunVariants.
+static bool Replay(const CommandLine& command_line, FrameScheduler& scheduler, vector<BenchmarkResult>& results, bool& out_checks_passed)
+{
+	const auto time_0 = std::chrono::steady_clock::now();
+	GraphReplay replay(command_line.replay_.c_str());
+	const auto time_1 = std::chrono::steady_clock::now();
+	if (!replay.IsValid())
+	{
+		std::clog << "Can't load the capture: " << command_line.replay_ << std::endl;
+		return false;
+	}
+	std::clog << "Loaded " << replay.GetNumObjects() << " objects, " << replay.GetNumDependencies() << " dependencies, "
+		<< replay.GetNumConstDependencies() << " const dependencies in [us]: " << std::chrono::duration<double, std::micro>(time_1 - time_0).count() << std::endl;
+	const uint32_t num_clusters = replay.CountPeakClusters();
+	if (replay.GetNumObjects() > static_cast<uint32_t>(kMaxObjects) || num_clusters > kMaxClusters)
+	{
+		std::clog << "Can't replay " << replay.GetNumObjects() << " objects, up to " << num_clusters << " clusters at once (limits: "
+			<< kMaxObjects << " objects, " << kMaxClusters << " clusters)" << std::endl;
+		return false;
 	}
 
-	return ms;
+	BenchmarkCase graph_case;
+	graph_case.shape_ = EGraphShape::Replay;
+	graph_case.num_objects_ = static_cast<int>(replay.GetNumObjects());
+	graph_case.forced_clusters_ = 0;
+	graph_case.dependencies_num_ = replay.GetNumObjects() ? static_cast<int>(replay.GetNumDependencies() / replay.GetNumObjects()) : 0;
+	graph_case.const_dependencies_num_ = replay.GetNumObjects() ? static_cast<int>(replay.GetNumConstDependencies() / replay.GetNumObjects()) : 0;
+	graph_case.const_locality_ = 0.0f;
+	graph_case.num_phases_ = static_cast<unsigned int>(command_line.num_phases_);
+	out_checks_passed = RunVariants(command_line, graph_case, replay.GetObjects(), scheduler, results, nullptr);
+	return true;
 }
 
-void main()
+int main(int argc, char** argv)
 {
-	constexpr int num_objects = 64 * 1024;
-	constexpr int forced_clusters = 64;
-	constexpr int dependencies_num = 16;
-	constexpr int const_dependencies_num = 8;
-
-#ifdef TEST_STUFF 
-	bool verbose = true;
-	int repeat_test = 1;
-#else
-	bool verbose = false;
-	int repeat_test = 2048;
+	CommandLine command_line;
+	if (!command_line.Parse(argc, argv))
+	{
+		CommandLine::PrintUsage();
+		return 1;
+	}
+
+	std::clog << "backend: " << Parallel::kBackendName << " pool: " << ChunkMemoryPool::GetName() << " telemetry: " << (MTOBJECTS_TELEMETRY ? "on" : "off") << std::endl;
+#if !MTOBJECTS_COROUTINES
+	if (command_line.time_slice_us_ != vector<int>{ 0 })
+	{
+		std::clog << "--time-slice ignored, built without coroutine support" << std::endl;
+		command_line.time_slice_us_ = { 0 };
+	}
 #endif
 
-	std::cout << "num_objects: " << num_objects << std::endl;
-	std::cout << "forced_clusters: " << forced_clusters << std::endl;
-	std::cout << "dependencies_num: " << dependencies_num << std::endl;
-	std::cout << "const_dependencies_num: " << const_dependencies_num << std::endl;
-
-	std::cout << std::endl;
-	
-	std::default_random_engine generator;
-	auto objects = GenerateObjects(num_objects, forced_clusters, dependencies_num, const_dependencies_num, generator);
-	auto shuffled_objects = ShuffleObjects(objects);
-
-	ClusterArray clusters;
-	long long all_time_ns = 0;
-	for (auto obj : shuffled_objects)
-	{
-		obj->Task();
-	}
-#ifndef TEST_STUFF
-	Test(shuffled_objects, clusters, verbose); // to cache the stuff
-#endif // TEST_STUFF
-	IF_TEST_STUFF(TestStuff::Reset());
-	for (int i = 0; i < repeat_test; i++)
-	{
-		std::cout << std::endl << "Test: " << i << std::endl;
-		all_time_ns += Test(shuffled_objects, clusters, verbose);
-	}
-	std::cout << std::endl << "Average time [ms]: " << all_time_ns / repeat_test << std::endl;
-	IF_TEST_STUFF(std::cout << "max_num_data_chunks_used: " << TestStuff::max_num_data_chunks_used() << std::endl);
-	IF_TEST_STUFF(std::cout << "objects_to_handle: " << TestStuff::max_num_objects_to_handle() << std::endl);
-	IF_TEST_STUFF(std::cout << "max_num_clusters: " << TestStuff::max_num_clusters() << std::endl);
-	IF_TEST_STUFF(std::cout << "num_obj_cluster_overwritten: " << TestStuff::num_obj_cluster_overwritten() << std::endl);
-	IF_TEST_STUFF(std::cout << "max_objects_to_merge: " << TestStuff::max_objects_to_merge() << std::endl);
-	getchar();
-}
\ No newline at end of file
+	if (command_line.barrier_benchmark_)
+	{
+		const vector<BarrierBenchmarkResult> barrier_results = RunBarrierBenchmark(command_line.num_threads_, command_line.warmup_, command_line.repeat_);
+		for (const BarrierBenchmarkResult& result : barrier_results)
+		{
+			std::clog << "threads: " << result.num_threads_ << " groups: " << result.num_groups_ << " per group [us] pool: " << result.pool_us_per_group_
+				<< " parallel_for: " << result.parallel_for_us_per_group_ << std::endl;
+		}
+		std::ofstream file;
+		if (!command_line.output_.empty())
+		{
+			file.open(command_line.output_);
+		}
+		WriteJson(command_line.output_.empty() ? std::cout : file, barrier_results);
+		return 0;
+	}
+
+	FrameScheduler scheduler;
+	vector<BenchmarkResult> results;
+	vector<ShardedBenchmarkResult> sharded_results;
+	bool checks_passed = true;
+	if (command_line.shards_ && !Sharding::ShardedWorld::IsSupported())
+	{
+		std::clog << "--shards needs Linux" << std::endl;
+		return 1;
+	}
+	if (!command_line.replay_.empty())
+	{
+		if (!Replay(command_line, scheduler, results, checks_passed))
+			return 1;
+	}
+	else for (EGraphShape shape : command_line.shapes_)
+	for (int num_objects : command_line.num_objects_)
+	for (int forced_clusters : command_line.forced_clusters_)
+	for (int dependencies_num : command_line.dependencies_num_)
+	for (int const_dependencies_num : command_line.const_dependencies_num_)
+	for (int const_locality_percent : command_line.const_locality_percent_)
+	{
+		// Without dependencies every object would be a cluster of its own
+		if (num_objects <= 0 || num_objects > kMaxObjects || forced_clusters > kMaxRegions || dependencies_num < 1)
+		{
+			std::clog << "Skipped objects: " << num_objects << " forced_clusters: " << forced_clusters << " deps: " << dependencies_num
+				<< " (limits: " << kMaxObjects << " objects, " << kMaxRegions << " forced clusters, 1 dependency)" << std::endl;
+			continue;
+		}
+
+		BenchmarkCase graph_case;
+		graph_case.shape_ = shape;
+		graph_case.num_objects_ = num_objects;
+		graph_case.forced_clusters_ = forced_clusters;
+		graph_case.dependencies_num_ = dependencies_num;
+		graph_case.const_dependencies_num_ = const_dependencies_num;
+		graph_case.const_locality_ = std::min(std::max(const_locality_percent, 0), 100) / 100.0f;
+		graph_case.critical_percent_ = command_line.critical_percent_;
+		graph_case.low_percent_ = std::min(command_line.low_percent_, 100 - command_line.critical_percent_);
+		graph_case.task_work_ = static_cast<unsigned int>(command_line.task_work_);
+		graph_case.task_memory_ = static_cast<unsigned int>(command_line.task_memory_);
+		graph_case.heavy_percent_ = command_line.heavy_percent_;
+		graph_case.num_phases_ = static_cast<unsigned int>(command_line.num_phases_);
+
+		std::default_random_engine generator(command_line.seed_);
+		auto objects = GenerateObjects(graph_case, generator);
+		AssignPriorities(graph_case, objects);
+		if (command_line.shards_)
+		{
+			graph_case.algorithm_ = command_line.algorithms_.front();
+			const unsigned int threads_per_shard = static_cast<unsigned int>(std::max(0, command_line.num_threads_.front()));
+			sharded_results.push_back(RunShardedBenchmark(graph_case, ShuffleObjects(objects), command_line.shards_, threads_per_shard, command_line.warmup_, command_line.repeat_));
+			const ShardedBenchmarkResult& sharded = sharded_results.back();
+			std::clog << "shape: " << ToString(shape) << " objects: " << num_objects << " shards: " << sharded.num_shards_
+				<< (sharded.succeeded_ ? "" : " FAILED") << " checksum: " << sharded.checksum_ << " single process: " << sharded.reference_checksum_
+				<< (sharded.checksum_ == sharded.reference_checksum_ ? " OK" : " MISMATCH") << std::endl;
+			checks_passed = checks_passed && sharded.succeeded_ && sharded.checksum_ == sharded.reference_checksum_;
+			for (const Sharding::ShardResult& shard : sharded.shards_)
+			{
+				std::clog << "  objects: " << shard.num_objects_ << " exported: " << shard.num_exported_ << " imported: " << shard.num_imported_
+					<< " median frame [us]: " << shard.frame_us_ << " exchange [us]: " << shard.exchange_us_ << std::endl;
+			}
+		}
+		else
+		{
+			checks_passed = RunVariants(command_line, graph_case, ShuffleObjects(objects), scheduler, results, &objects) && checks_passed;
+		}
+		DestroyObjects(objects);
+	}
+
+	if (!command_line.telemetry_baseline_.empty())
+	{
+		std::ifstream baseline_file(command_line.telemetry_baseline_);
+		const vector<double> baseline = ReadFrameMedians(baseline_file);
+		if (baseline.size() != results.size())
+		{
+			std::clog << "--telemetry-baseline ignored, " << baseline.size() << " variants in " << command_line.telemetry_baseline_ << ", " << results.size() << " here" << std::endl;
+		}
+		else for (size_t result_idx = 0; result_idx < results.size(); result_idx++)
+		{
+			BenchmarkResult& result = results[result_idx];
+			result.baseline_frame_us_ = baseline[result_idx];
+			std::clog << "variant " << result_idx << " median frame [us] telemetry " << (MTOBJECTS_TELEMETRY ? "on: " : "off: ") << result.frame_us_.median_
+				<< " baseline: " << result.baseline_frame_us_ << " overhead: " << (result.baseline_frame_us_ > 0.0 ? (result.frame_us_.median_ / result.baseline_frame_us_ - 1.0) * 100.0 : 0.0) << "%" << std::endl;
+		}
+	}
+
+	if (!command_line.decision_log_.empty())
+	{
+		std::ofstream file(command_line.decision_log_);
+		scheduler.GetClusteringPolicy().WriteLog(file);
+	}
+
+	std::ofstream file;
+	if (!command_line.output_.empty())
+	{
+		file.open(command_line.output_);
+	}
+	std::ostream& out = command_line.output_.empty() ? std::cout : file;
+	if (command_line.shards_)
+	{
+		WriteJson(out, sharded_results);
+	}
+	else
+	{
+		WriteJson(out, results);
+	}
+	return checks_passed ? 0 : 1;
+}